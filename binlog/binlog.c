@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "binlog.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#define LOG_MAX_SITES 1024 // distinct formats, power of two
+#define LOG_OUT_SIZE (64 * 1024) // binary records are written in chunks of whole records
+#define LOG_LINE_MAX 4096
+
+// Single producer (the owning thread), single consumer (whoever holds flush_lock)
+typedef struct log_ring
+{
+    uint64_t head __attribute__((aligned(64))); // written by the owner
+    uint64_t tail __attribute__((aligned(64))); // written by the flusher
+    uint64_t dropped; // full ring or a signal handler cutting into an event
+    uint64_t reported; // dropped count already written out
+    volatile sig_atomic_t busy; // the owner is inside log_event
+    pid_t tid;
+    char *data;
+    struct log_ring *next;
+} log_ring;
+
+int log_level = LOG_DEBUG;
+
+static log_ring *rings; // every thread that logged, pushed with CAS
+static __thread log_ring *own_ring;
+static log_site *sites[LOG_MAX_SITES]; // by id, for printing text
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t flusher;
+static int running; // the flusher drains the rings, otherwise records are written at once
+static int stopping;
+static int initialized;
+static pid_t log_pid;
+
+static int out_fd = -1; // -1 prints text on stdout
+static char out_buf[LOG_OUT_SIZE];
+static size_t out_len;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+uint32_t log_format_id(const char *format)
+{
+    uint32_t id = 2166136261u; // FNV-1a
+
+    for (; *format; format++)
+        id = (id ^ (uint8_t) *format) * 16777619u;
+    // Ids are the same in every process, so forked children share formats
+    return id <= LOG_ID_DROPPED ? id + 2 : id;
+}
+
+// Conversion starting after a '%', returns the character past it
+static const char *scan_spec(const char *f, int *type)
+{
+    int longs = 0, long_double = 0;
+
+    f += strspn(f, "-+ #0'123456789.");
+    for (; *f && strchr("hljztqL", *f); f++)
+    {
+        if (*f == 'L')
+            long_double = 1;
+        else if (*f != 'h')
+            longs += *f == 'q' ? 2 : 1;
+    }
+
+    switch (*f)
+    {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            *type = longs == 0 ? LOG_ARG_INT : longs == 1 ? LOG_ARG_LONG : LOG_ARG_LLONG;
+            break;
+        case 'c':
+            *type = longs ? -1 : LOG_ARG_INT;
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            *type = long_double ? -1 : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            *type = longs ? -1 : LOG_ARG_STRING;
+            break;
+        case 'p':
+            *type = LOG_ARG_POINTER;
+            break;
+        default: // '*' widths, %n
+            *type = -1;
+    }
+    return *f ? f + 1 : f;
+}
+
+int log_parse_format(const char *format, uint8_t *types)
+{
+    int nargs = 0, type;
+
+    while ((format = strchr(format, '%')))
+    {
+        if (format[1] == '%')
+        {
+            format += 2;
+            continue;
+        }
+        format = scan_spec(format + 1, &type);
+        if (type < 0 || nargs == LOG_MAX_ARGS)
+            return -1;
+        types[nargs++] = type;
+    }
+    return nargs;
+}
+
+int log_format(char *buf, size_t size, const char *format, log_record *r)
+{
+    char spec[32], *p = (char *) (r + 1), *end = (char *) r + r->size;
+    const char *start;
+    size_t len = 0;
+    int type, n;
+
+#define ROOM (len < size ? buf + len : NULL), (len < size ? size - len : 0)
+    while (*format)
+    {
+        if (*format != '%' || format[1] == '%')
+        {
+            if (len + 1 < size)
+                buf[len] = *format;
+            len++;
+            format += *format == '%' ? 2 : 1;
+            continue;
+        }
+        start = format;
+        format = scan_spec(format + 1, &type);
+        if (type < 0 || format - start >= (int) sizeof(spec) || p + 8 > end)
+            break;
+        memcpy(spec, start, format - start);
+        spec[format - start] = '\0';
+
+        switch (type)
+        {
+            case LOG_ARG_INT:
+                n = snprintf(ROOM, spec, (int) *(int64_t *) p);
+                break;
+            case LOG_ARG_LONG:
+                n = snprintf(ROOM, spec, (long) *(int64_t *) p);
+                break;
+            case LOG_ARG_LLONG:
+                n = snprintf(ROOM, spec, (long long) *(int64_t *) p);
+                break;
+            case LOG_ARG_DOUBLE:
+                n = snprintf(ROOM, spec, *(double *) p);
+                break;
+            case LOG_ARG_POINTER:
+                n = snprintf(ROOM, spec, (void *) *(uintptr_t *) p);
+                break;
+            default:
+                n = snprintf(ROOM, spec, p);
+                p += (strnlen(p, end - p) + 8) & ~7;
+                len += n;
+                continue;
+        }
+        p += 8;
+        len += n;
+    }
+#undef ROOM
+    if (size)
+        buf[len < size ? len : size - 1] = '\0';
+    return len;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Records are stamped with the TSC, clock_gettime costs as much as the rest
+// of an event. Ticks become CLOCK_REALTIME when the records are written out.
+static uint64_t tsc_base, real_base, mono_base;
+static double ns_per_tick;
+
+static inline uint64_t ticks(void)
+{
+    return __rdtsc();
+}
+
+// With flush_lock held. The first call waits a millisecond for a rate, later
+// ones refine it over the growing baseline.
+static void calibrate(void)
+{
+    if (!tsc_base)
+    {
+        tsc_base = __rdtsc();
+        real_base = clock_ns(CLOCK_REALTIME);
+        mono_base = clock_ns(CLOCK_MONOTONIC);
+        while (clock_ns(CLOCK_MONOTONIC) - mono_base < 1000000)
+            ;
+    }
+    ns_per_tick = (double) (clock_ns(CLOCK_MONOTONIC) - mono_base) / (__rdtsc() - tsc_base);
+}
+
+static uint64_t ticks_to_ns(uint64_t t)
+{
+    if (!tsc_base)
+        calibrate();
+    return real_base + (int64_t) ((int64_t) (t - tsc_base) * ns_per_tick);
+}
+#else
+static inline uint64_t ticks(void)
+{
+    return clock_ns(CLOCK_REALTIME);
+}
+
+static void calibrate(void)
+{
+}
+
+static uint64_t ticks_to_ns(uint64_t t)
+{
+    return t;
+}
+#endif
+
+static log_ring *ring_create(void)
+{
+    log_ring *ring, *head;
+
+    if (posix_memalign((void **) &ring, 64, sizeof(log_ring)))
+        ERR("posix_memalign");
+    memset(ring, 0, sizeof(log_ring));
+    if (NULL == (ring->data = malloc(LOG_RING_SIZE)))
+        ERR("malloc");
+    ring->tid = syscall(SYS_gettid);
+    if (!log_pid)
+        log_pid = getpid();
+
+    head = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    do
+        ring->next = head;
+    while (!__atomic_compare_exchange_n(&rings, &head, ring, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    return own_ring = ring;
+}
+
+static void ring_copy(log_ring *ring, uint64_t pos, void *buf, size_t size)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1), first = LOG_RING_SIZE - off;
+
+    if (first >= size)
+        memcpy(buf, ring->data + off, size);
+    else
+    {
+        memcpy(buf, ring->data + off, first);
+        memcpy((char *) buf + first, ring->data, size - first);
+    }
+}
+
+static void write_out(void)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < out_len)
+    {
+        if ((n = write(out_fd, out_buf + done, out_len - done)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("write");
+        }
+        done += n;
+    }
+    out_len = 0;
+}
+
+// With flush_lock held
+static void emit_record(log_record *r)
+{
+    char line[LOG_LINE_MAX];
+    uint32_t i;
+    log_site *site;
+
+    r->time = ticks_to_ns(r->time);
+    if (out_fd >= 0)
+    {
+        if (out_len + r->size > LOG_OUT_SIZE)
+            write_out();
+        memcpy(out_buf + out_len, r, r->size);
+        out_len += r->size;
+        return;
+    }
+
+    if (r->id == LOG_ID_FORMAT)
+        return;
+    if (r->id == LOG_ID_DROPPED)
+    {
+        printf("[binlog] %lu records dropped\n", *(uint64_t *) (r + 1));
+        return;
+    }
+    for (i = r->id;; i++)
+    {
+        site = __atomic_load_n(&sites[i & (LOG_MAX_SITES - 1)], __ATOMIC_ACQUIRE);
+        if (!site || site->id == r->id || i - r->id == LOG_MAX_SITES)
+            break;
+    }
+    if (site && site->id == r->id)
+    {
+        log_format(line, sizeof(line), site->format, r);
+        fputs(line, stdout);
+    }
+}
+
+static void stamp(log_record *r, log_ring *ring, uint32_t id)
+{
+    r->id = id;
+    r->time = ticks();
+    r->pid = log_pid;
+    r->tid = ring->tid;
+}
+
+// With flush_lock held
+static void drain_rings(void)
+{
+    uint64_t buf[LOG_RECORD_MAX / 8 + 1], head, tail, dropped;
+    log_record *r = (log_record *) buf;
+    log_ring *ring;
+
+    calibrate();
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail < head; tail += r->size)
+        {
+            ring_copy(ring, tail, r, sizeof(log_record));
+            ring_copy(ring, tail, r, r->size);
+            emit_record(r);
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            r->size = sizeof(log_record) + 8;
+            stamp(r, ring, LOG_ID_DROPPED);
+            *(uint64_t *) (r + 1) = dropped - ring->reported;
+            emit_record(r);
+            ring->reported = dropped;
+        }
+    }
+    if (out_fd >= 0)
+        write_out();
+    else
+        fflush(stdout);
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    drain_rings();
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void log_push(log_ring *ring, log_record *r)
+{
+    uint64_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t off = head & (LOG_RING_SIZE - 1), first = LOG_RING_SIZE - off;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&flush_lock);
+        emit_record(r);
+        if (out_fd >= 0)
+            write_out();
+        else
+            fflush(stdout);
+        pthread_mutex_unlock(&flush_lock);
+        return;
+    }
+
+    if (head - tail + r->size > LOG_RING_SIZE)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (first >= r->size)
+        memcpy(ring->data + off, r, r->size);
+    else
+    {
+        memcpy(ring->data + off, r, first);
+        memcpy(ring->data, (char *) r + first, r->size - first);
+    }
+    __atomic_store_n(&ring->head, head + r->size, __ATOMIC_RELEASE);
+}
+
+// The first event of a site parses its format and writes the format record
+// ahead of it. Threads racing for a new site wait for the winner.
+static void site_register(log_site *site, log_ring *ring)
+{
+    uint64_t buf[LOG_RECORD_MAX / 8];
+    log_record *r = (log_record *) buf;
+    char *text = (char *) (r + 1) + 8;
+    size_t len, room = sizeof(buf) - sizeof(log_record) - 8;
+    log_site *empty;
+    int state = 0;
+    uint32_t i;
+
+    if (!__atomic_compare_exchange_n(&site->state, &state, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&site->state, __ATOMIC_ACQUIRE) != 2)
+            sched_yield();
+        return;
+    }
+
+    site->nargs = log_parse_format(site->format, site->types);
+    site->id = log_format_id(site->format);
+    for (i = site->id; i - site->id < LOG_MAX_SITES; i++)
+    {
+        empty = NULL;
+        if (__atomic_compare_exchange_n(&sites[i & (LOG_MAX_SITES - 1)], &empty, site, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_ACQUIRE)
+            || empty->id == site->id)
+            break;
+    }
+
+    len = strnlen(site->format, room - 1);
+    memset(text, 0, room);
+    memcpy(text, site->format, len);
+    ((uint32_t *) (r + 1))[0] = site->id;
+    ((int32_t *) (r + 1))[1] = site->level;
+    r->size = sizeof(log_record) + 8 + ((len + 8) & ~7);
+    stamp(r, ring, LOG_ID_FORMAT);
+    log_push(ring, r);
+
+    __atomic_store_n(&site->state, 2, __ATOMIC_RELEASE);
+}
+
+void log_event(log_site *site, ...)
+{
+    uint64_t buf[LOG_RECORD_MAX / 8];
+    log_record *r = (log_record *) buf;
+    char *p = (char *) (r + 1), *s;
+    log_ring *ring = own_ring;
+    size_t len;
+    va_list ap;
+    int i;
+
+    if (!ring)
+        ring = ring_create();
+    // A signal handler logging into an event it interrupted would tear the ring
+    if (ring->busy)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&site->state, __ATOMIC_ACQUIRE) != 2)
+        site_register(site, ring);
+
+    va_start(ap, site);
+    if (site->nargs < 0)
+        vprintf(site->format, ap);
+    for (i = 0; i < site->nargs; i++)
+    {
+        switch (site->types[i])
+        {
+            case LOG_ARG_INT:
+                *(int64_t *) p = va_arg(ap, int);
+                break;
+            case LOG_ARG_LONG:
+                *(int64_t *) p = va_arg(ap, long);
+                break;
+            case LOG_ARG_LLONG:
+                *(int64_t *) p = va_arg(ap, long long);
+                break;
+            case LOG_ARG_DOUBLE:
+                *(double *) p = va_arg(ap, double);
+                break;
+            case LOG_ARG_POINTER:
+                *(uintptr_t *) p = (uintptr_t) va_arg(ap, void *);
+                break;
+            case LOG_ARG_STRING:
+                if (NULL == (s = va_arg(ap, char *)))
+                    s = "(null)";
+                len = strnlen(s, LOG_STRING_MAX - 1);
+                memcpy(p, s, len);
+                memset(p + len, 0, 8 - (len & 7));
+                p += (len + 8) & ~7;
+                continue;
+        }
+        p += 8;
+    }
+    va_end(ap);
+
+    if (site->nargs >= 0)
+    {
+        r->size = p - (char *) buf;
+        stamp(r, ring, site->id);
+        log_push(ring, r);
+    }
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    ring->busy = 0;
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+static void *flusher_work(void *arg)
+{
+    struct timespec delay = {0, LOG_FLUSH_MS * 1000000L};
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&delay, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+// Signals stay with the threads of the program, they often interrupt its syscalls
+static void start_flusher(void)
+{
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    stopping = 0;
+    if (pthread_create(&flusher, NULL, flusher_work, NULL))
+        ERR("pthread_create");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+}
+
+void log_close(void)
+{
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(flusher, NULL);
+    }
+    log_flush();
+}
+
+// Nothing logged before the fork may be written twice, so the rings are
+// drained and the child starts with its own ring and flusher
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    drain_rings();
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void fork_child(void)
+{
+    pthread_mutex_unlock(&flush_lock);
+    log_pid = getpid();
+    if (own_ring)
+    {
+        own_ring->tid = syscall(SYS_gettid);
+        own_ring->next = NULL;
+        own_ring->dropped = own_ring->reported = 0;
+    }
+    rings = own_ring;
+    if (running)
+        start_flusher();
+}
+
+static int parse_level(char *name)
+{
+    for (int i = 0; i < (int) (sizeof(level_names) / sizeof(level_names[0])); i++)
+        if (!strcasecmp(name, level_names[i]))
+            return i;
+    return atoi(name);
+}
+
+void log_init(void)
+{
+    char *path = getenv("BINLOG"), *level = getenv("LOG_LEVEL");
+
+    if (initialized)
+        return;
+    initialized = 1;
+
+    if (level)
+        log_set_level(parse_level(level));
+    // Appended, so processes of one run can share the file
+    if (path && (out_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        ERR("open");
+    log_pid = getpid();
+    if (!own_ring)
+        ring_create();
+    pthread_mutex_lock(&flush_lock);
+    calibrate();
+    pthread_mutex_unlock(&flush_lock);
+
+    if (pthread_atfork(fork_prepare, fork_parent, fork_child))
+        ERR("pthread_atfork");
+    if (atexit(log_close))
+        ERR("atexit");
+    start_flusher();
+}
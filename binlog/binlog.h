@@ -0,0 +1,91 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Asynchronous logger shared by the labs. LOG() copies the arguments of an
+// event into a lock-free ring of the calling thread as a binary record
+// (format id plus raw arguments), a background thread formats or writes the
+// records out. Nothing on the calling side takes a lock or enters the kernel.
+//
+// BINLOG=path appends binary records to path, to be read with logdecode,
+// otherwise the flusher prints the formatted text on stdout.
+// LOG_LEVEL=error|warn|info|debug (or 0-3) sets the verbosity, debug by default.
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_MAX_ARGS 8
+#define LOG_STRING_MAX 64 // longer %s arguments are cut
+#define LOG_RECORD_MAX (sizeof(log_record) + LOG_MAX_ARGS * LOG_STRING_MAX)
+#define LOG_RING_SIZE (1 << 20) // bytes per thread, power of two
+#define LOG_FLUSH_MS 20
+
+// Reserved ids, any other id is the hash of a format string
+#define LOG_ID_FORMAT 0 // payload: format id, level, format string
+#define LOG_ID_DROPPED 1 // payload: records lost since the last report
+
+// Argument types, as the format string promises them
+#define LOG_ARG_INT 0
+#define LOG_ARG_LONG 1
+#define LOG_ARG_LLONG 2
+#define LOG_ARG_DOUBLE 3
+#define LOG_ARG_STRING 4
+#define LOG_ARG_POINTER 5
+
+// Record header, followed by one 8-byte word per argument. A string takes its
+// bytes and a NUL, padded to a multiple of 8.
+typedef struct log_record
+{
+    uint32_t size; // header included, multiple of 8
+    uint32_t id;
+    uint64_t time; // CLOCK_REALTIME ns once written out, TSC ticks in the ring
+    int32_t pid, tid;
+} log_record;
+
+// One per LOG() call site, filled on its first event
+typedef struct log_site
+{
+    const char *format;
+    int level;
+    int state; // 0 - new, 1 - being registered, 2 - ready
+    uint32_t id;
+    int nargs;
+    uint8_t types[LOG_MAX_ARGS];
+} log_site;
+
+extern int log_level;
+
+#define LOG(level, format, ...)                                               \
+    do                                                                        \
+    {                                                                         \
+        static log_site log_site_ = {format, level};                          \
+        if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))         \
+            log_event(&log_site_, ##__VA_ARGS__);                             \
+    } while (0)
+
+// Reads BINLOG and LOG_LEVEL and starts the flusher. Call it before creating
+// threads or forking, a forked child gets its own flusher and the records
+// are flushed at exit.
+void log_init(void);
+void log_set_level(int level);
+void log_event(log_site *site, ...);
+
+// Write out everything logged so far
+void log_flush(void);
+
+// Flush and stop the flusher, LOG() prints synchronously afterwards
+void log_close(void);
+
+// Argument types of a format, -1 for a format the logger cannot carry
+int log_parse_format(const char *format, uint8_t *types);
+
+// Format the arguments of a record into buf, returns the length like snprintf
+int log_format(char *buf, size_t size, const char *format, log_record *r);
+
+uint32_t log_format_id(const char *format);
+
+#endif
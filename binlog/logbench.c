@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "binlog.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#define DEFAULT_EVENTS 200000
+#define DEFAULT_BURST 10000
+#define DEFAULT_THREADS 1
+#define MAX_THREADS 64
+
+// Times the calling side of printf and of LOG() with the lines the lab
+// programs print per request. Events come in bursts that fit in a ring, with
+// a pause for the flusher in between, so no record is dropped. Results go to
+// stderr, stdout is the log: redirect it to a file or to /dev/null, and set
+// BINLOG to time binary records.
+
+typedef struct bench
+{
+    pthread_t tid;
+    int id;
+    long events, burst;
+    int use_log;
+    double ns; // per event
+} bench;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-n events] [-b burst] [-t threads]\n", name);
+    fprintf(stderr, "events - events per thread (default %d)\n", DEFAULT_EVENTS);
+    fprintf(stderr, "burst - events logged without a pause (default %d)\n", DEFAULT_BURST);
+    fprintf(stderr, "threads - logging threads (default %d, max %d)\n", DEFAULT_THREADS, MAX_THREADS);
+}
+
+double monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+void *bench_work(void *arg)
+{
+    bench *b = arg;
+    struct timespec pause = {0, 2 * LOG_FLUSH_MS * 1000000L};
+    double spent = 0, start;
+
+    for (long done = 0; done < b->events; done += b->burst)
+    {
+        start = monotonic_ns();
+        for (long i = done; i < done + b->burst && i < b->events; i++)
+        {
+            if (b->use_log)
+                LOG(LOG_DEBUG, "[%d] Number received: %ld, sent: %s\n", b->id, i, "ok");
+            else
+                printf("[%d] Number received: %ld, sent: %s\n", b->id, i, "ok");
+        }
+        spent += monotonic_ns() - start;
+        if (!b->use_log)
+            fflush(stdout);
+        nanosleep(&pause, NULL);
+    }
+    b->ns = spent / b->events;
+    return NULL;
+}
+
+void run(int use_log, int threads, long events, long burst)
+{
+    bench b[MAX_THREADS];
+    double ns = 0;
+
+    for (int i = 0; i < threads; i++)
+    {
+        b[i].id = i;
+        b[i].events = events;
+        b[i].burst = burst;
+        b[i].use_log = use_log;
+        if (pthread_create(&b[i].tid, NULL, bench_work, &b[i]))
+            ERR("pthread_create");
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_join(b[i].tid, NULL))
+            ERR("pthread_join");
+        ns += b[i].ns;
+    }
+    fprintf(stderr, "%-7s %d threads: %8.1f ns/event\n", use_log ? "LOG" : "printf", threads, ns / threads);
+}
+
+int main(int argc, char **argv)
+{
+    long events = DEFAULT_EVENTS, burst = DEFAULT_BURST;
+    int threads = DEFAULT_THREADS, c;
+
+    while ((c = getopt(argc, argv, "n:b:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                events = atol(optarg);
+                break;
+            case 'b':
+                burst = atol(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc != optind || events < 1 || burst < 1 || threads < 1 || threads > MAX_THREADS)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    log_init();
+    run(0, threads, events, burst);
+    run(1, threads, events, burst);
+    log_close();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "binlog.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#define MAX_FORMATS 4096 // power of two
+
+typedef struct format
+{
+    uint32_t id;
+    int level;
+    char *text;
+} format;
+
+typedef struct event
+{
+    log_record *record;
+    size_t order; // position in the input, keeps sorting stable
+} event;
+
+static format formats[MAX_FORMATS];
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-l level] [-p pid] file...\n", name);
+    fprintf(stderr, "level - highest level printed, 0 (error) - 3 (debug)\n");
+    fprintf(stderr, "pid - print the events of this process only\n");
+    exit(EXIT_FAILURE);
+}
+
+static format *find_format(uint32_t id)
+{
+    uint32_t i;
+
+    for (i = id; i - id < MAX_FORMATS; i++)
+    {
+        format *f = &formats[i & (MAX_FORMATS - 1)];
+        if (!f->text || f->id == id)
+            return f;
+    }
+    fprintf(stderr, "Too many formats\n");
+    exit(EXIT_FAILURE);
+}
+
+static char *read_file(char *path, size_t *size)
+{
+    struct stat st;
+    char *data;
+    FILE *f;
+
+    if (NULL == (f = fopen(path, "r")))
+        ERR("fopen");
+    if (fstat(fileno(f), &st))
+        ERR("fstat");
+    if (NULL == (data = malloc(st.st_size + 1)))
+        ERR("malloc");
+    if (fread(data, 1, st.st_size, f) != (size_t) st.st_size)
+        ERR("fread");
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
+
+static int compare_events(const void *a, const void *b)
+{
+    const event *x = a, *y = b;
+
+    if (x->record->time != y->record->time)
+        return x->record->time < y->record->time ? -1 : 1;
+    return x->order < y->order ? -1 : 1;
+}
+
+// Records of every file, format records go straight to the table
+static event *load_events(char **paths, int count, size_t *total)
+{
+    size_t size, pos, n = 0, capacity = 1024;
+    event *events;
+    log_record *r;
+    format *f;
+    char *data;
+
+    if (NULL == (events = malloc(capacity * sizeof(event))))
+        ERR("malloc");
+    for (int i = 0; i < count; i++)
+    {
+        data = read_file(paths[i], &size);
+        for (pos = 0; pos + sizeof(log_record) <= size; pos += r->size)
+        {
+            r = (log_record *) (data + pos);
+            if (r->size < sizeof(log_record) || r->size % 8 || pos + r->size > size)
+            {
+                fprintf(stderr, "%s: broken record at %zu\n", paths[i], pos);
+                break;
+            }
+            if (r->id == LOG_ID_FORMAT)
+            {
+                f = find_format(*(uint32_t *) (r + 1));
+                if (!f->text)
+                {
+                    f->id = *(uint32_t *) (r + 1);
+                    f->level = ((int32_t *) (r + 1))[1];
+                    f->text = (char *) (r + 1) + 8;
+                }
+                continue;
+            }
+            if (n == capacity && NULL == (events = realloc(events, (capacity *= 2) * sizeof(event))))
+                ERR("realloc");
+            events[n].record = r;
+            events[n].order = n;
+            n++;
+        }
+    }
+    *total = n;
+    return events;
+}
+
+static void print_event(log_record *r, char *text)
+{
+    char stamp[32];
+    struct tm tm;
+    time_t sec = r->time / 1000000000;
+    size_t len;
+
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    len = strlen(text);
+    printf("%s.%06lu %d/%d %s%s", stamp, (unsigned long) (r->time % 1000000000 / 1000), r->pid, r->tid, text,
+           len && text[len - 1] == '\n' ? "" : "\n");
+}
+
+int main(int argc, char **argv)
+{
+    char line[4096];
+    size_t count;
+    event *events;
+    log_record *r;
+    format *f;
+    int level = LOG_DEBUG, pid = 0, c;
+
+    while ((c = getopt(argc, argv, "l:p:")) != -1)
+    {
+        switch (c)
+        {
+            case 'l':
+                level = atoi(optarg);
+                break;
+            case 'p':
+                pid = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind == argc)
+        usage(argv[0]);
+
+    events = load_events(argv + optind, argc - optind, &count);
+    qsort(events, count, sizeof(event), compare_events);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        r = events[i].record;
+        if (pid && r->pid != pid)
+            continue;
+        if (r->id == LOG_ID_DROPPED)
+        {
+            fprintf(stderr, "%d/%d: %lu records dropped\n", r->pid, r->tid, *(uint64_t *) (r + 1));
+            continue;
+        }
+        f = find_format(r->id);
+        if (!f->text)
+        {
+            snprintf(line, sizeof(line), "unknown format %08x", r->id);
+            print_event(r, line);
+            continue;
+        }
+        if (f->level > level)
+            continue;
+        log_format(line, sizeof(line), f->text, r);
+        print_event(r, line);
+    }
+    return EXIT_SUCCESS;
+}
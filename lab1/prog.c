@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <time.h>
 #include <limits.h>
+#include "binlog.h"
 
 #ifndef TEMP_FAILURE_RETRY
 #define TEMP_FAILURE_RETRY(exp) ({ \
@@ -112,6 +113,7 @@ void child_work(int *fd)
 	char *readMsg, *writeMsg;
 	unsigned char readLength, writeLength;
 	int number;
+	pid_t pid = getpid();
 
 	while(last_signal != SIGINT)
 	{
@@ -122,7 +124,7 @@ void child_work(int *fd)
 		if (TEMP_FAILURE_RETRY(read(readfd, readMsg, readLength)) < readLength)
 			if (errno != EINTR && errno != EPIPE) ERR("read");
 		number = atoi(readMsg);
-		printf("[%d] read msg: %d\n", getpid(), number);
+		LOG(LOG_DEBUG, "[%d] read msg: %d\n", pid, number);
 		sleep(1);
 
 		// Write
@@ -165,7 +167,7 @@ void parent_work(int *fd)
 		if (TEMP_FAILURE_RETRY(read(readfd, readMsg, readLength)) < readLength)
 			if (errno != EINTR && errno != EPIPE) ERR("read");
 		number = atoi(readMsg);
-		printf("[PARENT] read msg: %d\n", number);
+		LOG(LOG_DEBUG, "[PARENT] read msg: %d\n", number);
 		sleep(1);
 
 		//free(readMsg);
@@ -228,6 +230,7 @@ int main(int argc, char** argv)
 	if (sethandler(sig_handler, SIGINT)) ERR("Setting SIGINT handler");
     if (sethandler(SIG_IGN, SIGPIPE)) ERR("Setting SIGINT handler");
     if (sethandler(sigchld_handler, SIGCHLD)) ERR("Setting parent SIGCHLD:");
+    log_init(); // przed fork, potomkowie dostaja wlasny watek zapisujacy
 
     int n = 3; // ilość procesów w "obiegu"
     int fd[2], *fds;
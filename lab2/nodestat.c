@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "nodestat.h"
+
+#define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
+                     perror(source),exit(EXIT_FAILURE))
+
+static const char *typeNames[NODESTAT_TYPES] = {"registration", "text", "exit"};
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s pid [interval]\n", name);
+    fprintf(stderr, "pid - node to inspect\n");
+    fprintf(stderr, "interval - sample every interval ms until the node exits\n");
+    exit(EXIT_FAILURE);
+}
+
+uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+nodeStats *mapStats(pid_t pid)
+{
+	char name[50];
+	nodeStats *stats;
+	int fd;
+
+	sprintf(name, "/%d_stats", pid);
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+	{
+		if (errno == ENOENT)
+		{
+			fprintf(stderr, "No statistics for node %d\n", pid);
+			exit(EXIT_FAILURE);
+		}
+		ERR("shm_open");
+	}
+	if ((stats = mmap(NULL, sizeof(nodeStats), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) ERR("mmap");
+	if (close(fd)) ERR("close");
+
+	if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != NODESTAT_MAGIC)
+	{
+		fprintf(stderr, "Node %d has not published statistics yet\n", pid);
+		exit(EXIT_FAILURE);
+	}
+	return stats;
+}
+
+// Upper bound (ns) of the histogram bucket holding the given quantile
+uint64_t latencyQuantile(uint64_t latency[], double q)
+{
+	uint64_t total = 0, seen = 0;
+
+	for (int i = 0; i < NODESTAT_LATENCY_BUCKETS; i++)
+		total += latency[i];
+	if (total == 0)
+		return 0;
+
+	for (int i = 0; i < NODESTAT_LATENCY_BUCKETS; i++)
+	{
+		seen += latency[i];
+		if (seen >= q * total)
+			return 1ULL << i;
+	}
+	return 1ULL << (NODESTAT_LATENCY_BUCKETS - 1);
+}
+
+void printStats(nodeStats *stats)
+{
+	uint64_t latency[NODESTAT_LATENCY_BUCKETS];
+
+	printf("Node %d\n", stats->pid);
+	for (int i = 0; i < NODESTAT_TYPES; i++)
+		printf(" %-13s received %8lu sent %8lu\n", typeNames[i], load(&stats->received[i]), load(&stats->sent[i]));
+	printf(" delivered %lu forwarded %lu flooded %lu dropped %lu\n", load(&stats->delivered),
+		load(&stats->forwarded), load(&stats->flooded), load(&stats->dropped));
+	printf(" queue high-water %lu, outbox pending %lu (high-water %lu)\n", load(&stats->queueHighWater),
+		load(&stats->outboxPending), load(&stats->outboxHighWater));
+	printf(" open queues %lu, opened %lu, evicted %lu, peers removed %lu\n", load(&stats->openQueues),
+		load(&stats->queueOpens), load(&stats->queueEvictions), load(&stats->peersRemoved));
+
+	printf(" peers\n");
+	for (int i = 0; i < NODESTAT_PEERS; i++)
+	{
+		pid_t pid = __atomic_load_n(&stats->peers[i].pid, __ATOMIC_RELAXED);
+		if (pid)
+			printf("  %8d sent %8lu EAGAIN %8lu\n", pid, load(&stats->peers[i].sent), load(&stats->peers[i].eagain));
+	}
+
+	for (int i = 0; i < NODESTAT_LATENCY_BUCKETS; i++)
+		latency[i] = load(&stats->latency[i]);
+	printf(" hop latency p50 < %lu ns, p99 < %lu ns, max < %lu ns\n", latencyQuantile(latency, 0.5),
+		latencyQuantile(latency, 0.99), latencyQuantile(latency, 1.0));
+}
+
+// Print per-second rates between two samples
+void printRates(uint64_t previous[], uint64_t current[], double seconds)
+{
+	printf("[rates/s]");
+	for (int i = 0; i < NODESTAT_TYPES; i++)
+		printf(" %s in %.0f out %.0f", typeNames[i], (current[i] - previous[i]) / seconds,
+			(current[NODESTAT_TYPES + i] - previous[NODESTAT_TYPES + i]) / seconds);
+	printf("\n");
+}
+
+void sample(nodeStats *stats, uint64_t counters[])
+{
+	for (int i = 0; i < NODESTAT_TYPES; i++)
+	{
+		counters[i] = load(&stats->received[i]);
+		counters[NODESTAT_TYPES + i] = load(&stats->sent[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	nodeStats *stats;
+	pid_t pid;
+	int interval = 0;
+	uint64_t previous[2 * NODESTAT_TYPES], current[2 * NODESTAT_TYPES];
+
+	if (argc < 2 || argc > 3) usage(argv[0]);
+	pid = atoi(argv[1]);
+	if (argc == 3 && (interval = atoi(argv[2])) <= 0) usage(argv[0]);
+
+	stats = mapStats(pid);
+	printStats(stats);
+
+	if (interval)
+	{
+		struct timespec ts = {interval / 1000, (interval % 1000) * 1000000L};
+
+		sample(stats, previous);
+		while (0 == kill(pid, 0))
+		{
+			while (nanosleep(&ts, &ts) && errno == EINTR);
+			ts.tv_sec = interval / 1000;
+			ts.tv_nsec = (interval % 1000) * 1000000L;
+
+			sample(stats, current);
+			printRates(previous, current, interval / 1000.0);
+			memcpy(previous, current, sizeof(previous));
+		}
+		printStats(stats);
+	}
+
+	munmap(stats, sizeof(nodeStats));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#ifndef NODESTAT_H
+#define NODESTAT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Layout of the statistics block a node publishes in /PID_stats.
+// The node is the only writer, readers map it read-only and may see
+// counters of one sample taken at slightly different moments.
+
+#define NODESTAT_MAGIC 0x3254534d // "MST2"
+#define NODESTAT_TYPES 3 // REGISTRATION, TEXT, EXIT
+#define NODESTAT_PEERS 64
+#define NODESTAT_LATENCY_BUCKETS 40 // bucket i counts hops taking [2^(i-1), 2^i) ns
+
+typedef struct peerStats
+{
+	pid_t pid; // 0 - free slot
+	uint64_t sent;
+	uint64_t eagain;
+} peerStats;
+
+typedef struct nodeStats
+{
+	uint32_t magic;
+	pid_t pid;
+	uint64_t started; // CLOCK_MONOTONIC, ns
+
+	uint64_t received[NODESTAT_TYPES];
+	uint64_t sent[NODESTAT_TYPES];
+	uint64_t delivered; // text messages addressed to this node
+	uint64_t forwarded; // text messages sent to the known recipient
+	uint64_t flooded; // text messages sent to all neighbors but the sender
+	uint64_t dropped; // messages abandoned (unknown recipient, dead peer)
+
+	uint64_t queueHighWater; // deepest own queue seen when a notification is handled
+	uint64_t outboxPending;
+	uint64_t outboxHighWater;
+
+	uint64_t openQueues; // neighbor queues open right now
+	uint64_t queueOpens;
+	uint64_t queueEvictions; // queues closed to stay within the open queue limit (-q)
+	uint64_t peersRemoved; // neighbors forgotten because they are gone
+
+	uint64_t latency[NODESTAT_LATENCY_BUCKETS];
+
+	peerStats peers[NODESTAT_PEERS];
+} nodeStats;
+
+#endif
@@ -8,20 +8,45 @@
 #include <string.h>
 #include <time.h>
 #include <mqueue.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "nodestat.h"
+#include "binlog.h"
 
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
                                      exit(EXIT_FAILURE))
 
+// The node is the only writer of its statistics, readers only need untorn values
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(counter, v) __atomic_store_n(&(counter), (v), __ATOMIC_RELAXED)
+
+#ifndef MAX_PEERS
 #define MAX_PEERS 5
+#endif
+#ifndef MAX_OPEN_QUEUES
+#define MAX_OPEN_QUEUES ((MAX_PEERS + 1) / 2) // default limit of neighbor queues open at once
+#endif
 #define MAX_MESSAGES_COUNT 10
 #define MAX_MESSAGE_LENGTH 20
 #define MAX_MESSAGE_LENGTH_STR "20"
 
+#define JOURNAL_MAGIC 0x324a514d // "MQJ2"
+#define JOURNAL_RECORDS 4096
+#define JOURNAL_GROUP_COMMIT 64 // changes that wake the syncer before its interval
+#define JOURNAL_SYNC_MS 200 // longest a change waits for msync
+
 typedef struct neighbor
 {
 	pid_t pid;
-	mqd_t queue;
+	mqd_t queue; // -1 while closed
+	int prev, next; // list of open queues
+	peerStats *stats;
 } neighbor;
 
 typedef enum msgType {REGISTRATION, TEXT, EXIT} msgType;
@@ -31,6 +56,7 @@ typedef struct message
 	pid_t last; // last node to hold the message
 	pid_t from, to; // original from & to
 	msgType type;
+	uint64_t sent; // time of the last hop (CLOCK_MONOTONIC, ns)
 	char content[MAX_MESSAGE_LENGTH];
 } message;
 
@@ -39,13 +65,66 @@ struct node
 	pid_t pid;
 	char queueName[50];
 	mqd_t queue;
-	neighbor neighbors[MAX_PEERS];
-	int neighborsCount;
+	neighbor neighbors[MAX_PEERS]; // pid = 0 marks a free slot
+	int neighborsCount; // slots in use, including free ones
+	int openQueues;
+	int maxOpenQueues; // fewer than neighbors, so the least recently used queue gets closed
+	int lruHead, lruTail;
+	pid_t previousPid; // pid of the run restored from the journal
+	char statsName[50];
+	nodeStats *stats;
 } node;
 
+typedef enum recordKind {OUTBOX = 1, INBOX, PEER} recordKind;
+typedef enum recordState {PENDING = 1, DONE} recordState;
+
+typedef struct journalRecord
+{
+	uint32_t seq;
+	uint8_t kind;
+	uint8_t state;
+	uint16_t prio;
+	pid_t peer; // destination of an outbox record, pid of a peer record
+	message msg;
+} journalRecord;
+
+typedef struct journalHeader
+{
+	uint32_t magic;
+	uint32_t capacity;
+	uint32_t count; // records in use
+	uint32_t seq; // next sequence number
+	pid_t owner; // last node that used the journal
+	char queueName[50]; // its queue, drained on restart
+} journalHeader;
+
+// Append-only journal of the node's traffic, mapped from a file
+struct journal
+{
+	journalHeader *header;
+	journalRecord *records;
+	size_t size;
+	uint32_t unsynced; // changes since the last msync, shared with the syncer
+	uint32_t group; // changes that wake the syncer early, 0 - never
+	long syncMs;
+	int stop;
+	sem_t wake;
+	pthread_t syncer;
+	uint32_t outboxFirst; // lowest index which may hold a pending outbox record
+} journal;
+
+// Set by the handlers, the main loop shuts the node down:
+// -1 - SIGINT, otherwise pid of the neighbor which sent the exit request
+volatile sig_atomic_t exitFrom = 0;
+
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s [pid]\n", name);
+    fprintf(stderr, "USAGE: %s [-j journal] [-s ms] [-g changes] [-q queues] [pid]\n", name);
+    fprintf(stderr, "journal - file used to keep the node's traffic across restarts\n");
+    fprintf(stderr, "ms - longest time a journal change waits for msync (default %d)\n", JOURNAL_SYNC_MS);
+    fprintf(stderr, "changes - changes that trigger an earlier msync (default %d, 0 - interval only)\n",
+            JOURNAL_GROUP_COMMIT);
+    fprintf(stderr, "queues - neighbor queues open at once (default %d, max %d)\n", MAX_OPEN_QUEUES, MAX_PEERS);
     fprintf(stderr, "pid - process to connect with\n");
     exit(EXIT_FAILURE);
 }
@@ -55,6 +134,9 @@ void sethandler(void (*f)(int), int sigNo)
 	struct sigaction act;
 	memset(&act, 0, sizeof(struct sigaction));
 	act.sa_handler = f;
+	// The handlers share the node state, neither may interrupt the other
+	sigaddset(&act.sa_mask, SIGINT);
+	sigaddset(&act.sa_mask, SIGRTMIN);
 	if (-1 == sigaction(sigNo, &act, NULL)) ERR("sigaction");
 }
 
@@ -78,36 +160,393 @@ void initializeQueue()
     if ((node.queue = TEMP_FAILURE_RETRY(mq_open(node.queueName, O_RDWR | O_NONBLOCK | O_CREAT, 0600, &attr))) == (mqd_t) -1) ERR("mq_open");
 }
 
-// Open pid's queue (with no create)
+uint64_t monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Publish statistics block in shared memory
+void initializeStats()
+{
+	int fd;
+
+	sprintf(node.statsName, "/%d_stats", node.pid);
+
+	if ((fd = shm_open(node.statsName, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) ERR("shm_open");
+	if (ftruncate(fd, sizeof(nodeStats))) ERR("ftruncate");
+	if ((node.stats = mmap(NULL, sizeof(nodeStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) ERR("mmap");
+	if (close(fd)) ERR("close");
+
+	node.stats->pid = node.pid;
+	node.stats->started = monotonicNow();
+	__atomic_store_n(&node.stats->magic, NODESTAT_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Statistics slot of a peer, claimed on first use
+peerStats *peerStatsSlot(pid_t npid)
+{
+	for (int i = 0; i < NODESTAT_PEERS; i++)
+	{
+		peerStats *slot = &node.stats->peers[(npid + i) % NODESTAT_PEERS];
+		if (slot->pid == npid)
+			return slot;
+		if (slot->pid == 0)
+		{
+			STAT_SET(slot->pid, npid);
+			return slot;
+		}
+	}
+
+	// Table is full, the last slot collects the rest
+	return &node.stats->peers[NODESTAT_PEERS - 1];
+}
+
+void recordHopLatency(message *msg)
+{
+	uint64_t now = monotonicNow(), ns;
+	int bucket;
+
+	if (msg->sent == 0 || msg->sent > now)
+		return;
+
+	ns = now - msg->sent;
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= NODESTAT_LATENCY_BUCKETS)
+		bucket = NODESTAT_LATENCY_BUCKETS - 1;
+	STAT_ADD(node.stats->latency[bucket], 1);
+}
+
+// Map the journal file, creating it if needed
+void openJournal(char *path)
+{
+	int fd;
+	struct stat st;
+
+	journal.size = sizeof(journalHeader) + sizeof(journalRecord) * JOURNAL_RECORDS;
+
+	if ((fd = TEMP_FAILURE_RETRY(open(path, O_RDWR | O_CREAT, 0600))) < 0) ERR("open");
+	if (fstat(fd, &st)) ERR("fstat");
+	if ((size_t) st.st_size != journal.size && ftruncate(fd, journal.size)) ERR("ftruncate");
+
+	if ((journal.header = mmap(NULL, journal.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) ERR("mmap");
+	if (close(fd)) ERR("close");
+
+	journal.records = (journalRecord*) (journal.header + 1);
+
+	if (journal.header->magic != JOURNAL_MAGIC || journal.header->capacity != JOURNAL_RECORDS
+		|| journal.header->count > JOURNAL_RECORDS)
+	{
+		memset(journal.header, 0, sizeof(journalHeader));
+		journal.header->magic = JOURNAL_MAGIC;
+		journal.header->capacity = JOURNAL_RECORDS;
+	}
+}
+
+static inline void journalChanged()
+{
+	__atomic_add_fetch(&journal.unsynced, 1, __ATOMIC_RELAXED);
+}
+
+// Flush the journal to disk every syncMs, or sooner once group changes wait.
+// Data written to the mapping survives a crash of the process anyway, msync
+// only guards against losing the machine, so it is kept off the message path.
+void *journalSyncer(void *arg)
+{
+	struct timespec deadline;
+
+	while (!__atomic_load_n(&journal.stop, __ATOMIC_ACQUIRE))
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += journal.syncMs / 1000;
+		deadline.tv_nsec += journal.syncMs % 1000 * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if (sem_timedwait(&journal.wake, &deadline) && errno != ETIMEDOUT && errno != EINTR) ERR("sem_timedwait");
+		while (!sem_trywait(&journal.wake));
+
+		if (__atomic_exchange_n(&journal.unsynced, 0, __ATOMIC_ACQ_REL)
+			&& msync(journal.header, journal.size, MS_SYNC)) ERR("msync");
+	}
+	return NULL;
+}
+
+void startJournalSyncer()
+{
+	sigset_t mask, oldmask;
+
+	if (sem_init(&journal.wake, 0, 0)) ERR("sem_init");
+	// Signals are handled by the main thread only
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	if (pthread_create(&journal.syncer, NULL, journalSyncer, NULL)) ERR("pthread_create");
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+void stopJournalSyncer()
+{
+	__atomic_store_n(&journal.stop, 1, __ATOMIC_RELEASE);
+	if (sem_post(&journal.wake)) ERR("sem_post");
+	if (pthread_join(journal.syncer, NULL)) ERR("pthread_join");
+	sem_destroy(&journal.wake);
+}
+
+// Ask for the changes to be flushed to disk. sync flushes them before
+// returning, otherwise only the syncer is woken once group changes wait
+// (sem_post is safe in the queue signal handler).
+void journalCommit(int sync)
+{
+	if (!journal.header) return;
+
+	if (sync)
+	{
+		__atomic_store_n(&journal.unsynced, 0, __ATOMIC_RELAXED);
+		if (msync(journal.header, journal.size, MS_SYNC)) ERR("msync");
+	}
+	else if (journal.group && __atomic_load_n(&journal.unsynced, __ATOMIC_RELAXED) >= journal.group)
+	{
+		if (sem_post(&journal.wake)) ERR("sem_post");
+	}
+}
+
+int neighborIndex(pid_t npid);
+
+// Drop finished records, keeping the order (and so the sorted sequence numbers)
+void journalCompact()
+{
+	uint32_t j = 0;
+
+	for (uint32_t i = 0; i < journal.header->count; i++)
+	{
+		journalRecord *record = &journal.records[i];
+
+		if (record->kind == PEER ? neighborIndex(record->peer) == -1 : record->state == DONE)
+			continue;
+		if (i != j)
+			journal.records[j] = *record;
+		j++;
+	}
+
+	LOG(LOG_INFO, "[%d] Journal compacted: %u -> %u records\n", node.pid, journal.header->count, j);
+	journal.header->count = j;
+	journal.outboxFirst = 0;
+}
+
+// Append a record, returns its sequence number (0 if it was not journaled)
+uint32_t journalAppend(recordKind kind, pid_t peer, message *msg, unsigned prio)
+{
+	journalRecord *record;
+
+	if (!journal.header) return 0;
+
+	if (journal.header->count == journal.header->capacity)
+	{
+		journalCompact();
+		if (journal.header->count == journal.header->capacity)
+		{
+			LOG(LOG_WARN, "[%d] Journal full\n", node.pid);
+			return 0;
+		}
+	}
+
+	record = &journal.records[journal.header->count];
+	if (msg)
+		record->msg = *msg;
+	record->peer = peer;
+	record->prio = prio;
+	record->kind = kind;
+	record->state = PENDING;
+	record->seq = ++journal.header->seq;
+	journal.header->count++;
+	journalChanged();
+
+	return record->seq;
+}
+
+// Find record by its sequence number
+journalRecord *journalFind(uint32_t seq)
+{
+	uint32_t l = 0, r = journal.header->count;
+
+	while (l < r)
+	{
+		uint32_t m = (l + r) / 2;
+		if (journal.records[m].seq < seq)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	if (l < journal.header->count && journal.records[l].seq == seq)
+		return &journal.records[l];
+	return NULL;
+}
+
+void journalDone(uint32_t seq)
+{
+	journalRecord *record;
+
+	if (!journal.header || seq == 0) return;
+	if ((record = journalFind(seq)))
+	{
+		record->state = DONE;
+		journalChanged();
+	}
+}
+
+// Open pid's queue (with no create), returns -1 if the queue is gone
+// or no more descriptors are available
 mqd_t openQueue(pid_t pid)
 {
 	char queueName[50];
 	mqd_t queue;
 
 	sprintf(queueName, "/%d_queue", pid);
-	if ((queue = TEMP_FAILURE_RETRY(mq_open(queueName, O_RDWR | O_NONBLOCK))) == (mqd_t) -1) ERR("mq_open");
+	if ((queue = TEMP_FAILURE_RETRY(mq_open(queueName, O_RDWR | O_NONBLOCK))) == (mqd_t) -1)
+	{
+		if (errno == ENOENT || errno == EMFILE || errno == ENFILE)
+			return (mqd_t) -1;
+		ERR("mq_open");
+	}
 
 	return queue;
 }
 
+// Open queues are kept on a list, most recently used first
+void lruUnlink(int i)
+{
+	neighbor *n = &node.neighbors[i];
+
+	if (n->prev != -1)
+		node.neighbors[n->prev].next = n->next;
+	else
+		node.lruHead = n->next;
+	if (n->next != -1)
+		node.neighbors[n->next].prev = n->prev;
+	else
+		node.lruTail = n->prev;
+	n->prev = n->next = -1;
+}
+
+void lruPushFront(int i)
+{
+	neighbor *n = &node.neighbors[i];
+
+	n->prev = -1;
+	n->next = node.lruHead;
+	if (node.lruHead != -1)
+		node.neighbors[node.lruHead].prev = i;
+	else
+		node.lruTail = i;
+	node.lruHead = i;
+}
+
+void closeNeighborQueue(int i)
+{
+	lruUnlink(i);
+	mq_close(node.neighbors[i].queue);
+	node.neighbors[i].queue = (mqd_t) -1;
+	node.openQueues--;
+	STAT_SET(node.stats->openQueues, node.openQueues);
+}
+
+// Close the least recently used queue, it is reopened when needed again
+void evictQueue()
+{
+	closeNeighborQueue(node.lruTail);
+	STAT_ADD(node.stats->queueEvictions, 1);
+}
+
+// Forget a neighbor which is gone, its slot is reused by the next registration
+void removeNeighbor(neighbor *n)
+{
+	if (n->queue != (mqd_t) -1)
+		closeNeighborQueue(n - node.neighbors);
+
+	LOG(LOG_INFO, "[%d] Removed neighbor: %d\n", node.pid, n->pid);
+	n->pid = 0;
+	STAT_ADD(node.stats->peersRemoved, 1);
+}
+
+// Queue of a neighbor, opened on demand. Returns -1 (and removes the neighbor) if it is gone
+mqd_t neighborQueue(neighbor *n)
+{
+	int i = n - node.neighbors;
+
+	if (n->queue != (mqd_t) -1)
+	{
+		if (node.lruHead != i)
+		{
+			lruUnlink(i);
+			lruPushFront(i);
+		}
+		return n->queue;
+	}
+
+	if (node.openQueues >= node.maxOpenQueues)
+		evictQueue();
+
+	while ((n->queue = openQueue(n->pid)) == (mqd_t) -1 && errno != ENOENT && node.openQueues > 0)
+		evictQueue();
+
+	if (n->queue == (mqd_t) -1)
+	{
+		if (errno != ENOENT) ERR("mq_open");
+		removeNeighbor(n);
+		return (mqd_t) -1;
+	}
+
+	lruPushFront(i);
+	node.openQueues++;
+	STAT_SET(node.stats->openQueues, node.openQueues);
+	STAT_ADD(node.stats->queueOpens, 1);
+	return n->queue;
+}
+
 // Send register message after establishing a connection
-void sendRegistrationMessage(mqd_t queue)
+void sendRegistrationMessage(neighbor *n)
 {
 	message msg;
+	mqd_t queue;
 	msg.from = node.pid;
 	msg.type = REGISTRATION;
 
-	printf("[%d] Sending registration request\n", node.pid);
+	if ((queue = neighborQueue(n)) == (mqd_t) -1)
+		return;
+
+	LOG(LOG_INFO, "[%d] Sending registration request\n", node.pid);
 
+	msg.sent = monotonicNow();
 	if (TEMP_FAILURE_RETRY(mq_send(queue, (const char*) &msg, sizeof(message), 1))) ERR("mq_send");
+	STAT_ADD(n->stats->sent, 1);
+	STAT_ADD(node.stats->sent[REGISTRATION], 1);
 }
 
-mqd_t neighborQueue(pid_t npid)
+int neighborIndex(pid_t npid)
 {
 	for (int i = 0; i < node.neighborsCount; i++)
-		if(node.neighbors[i].pid == npid && checkProcess(npid))
-			return node.neighbors[i].queue;
-	return 0;
+		if (npid > 0 && node.neighbors[i].pid == npid)
+			return i;
+	return -1;
+}
+
+// Neighbor with that pid if it is still alive
+neighbor *findNeighbor(pid_t npid)
+{
+	int i = neighborIndex(npid);
+
+	if (i == -1)
+		return NULL;
+	if (!checkProcess(npid))
+	{
+		removeNeighbor(&node.neighbors[i]);
+		return NULL;
+	}
+	return &node.neighbors[i];
 }
 
 void printNeighbors()
@@ -115,39 +554,56 @@ void printNeighbors()
 	printf("[%d] Neighbors\n", node.pid);
 	for (int i = 0; i < node.neighborsCount; i++)
 	{
-		printf(" %d: %d\n", i, node.neighbors[i].pid);
+		if (node.neighbors[i].pid)
+			printf(" %d: %d\n", i, node.neighbors[i].pid);
 	}
 }
 
-neighbor createNeighbor(pid_t npid, mqd_t queue)
+neighbor createNeighbor(pid_t npid)
 {
 	neighbor neighbor;
 	neighbor.pid = npid;
-	neighbor.queue = queue;
+	neighbor.queue = (mqd_t) -1;
+	neighbor.prev = neighbor.next = -1;
+	neighbor.stats = peerStatsSlot(npid);
 	return neighbor;
 }
 
 // Add neighbor to neighbors
-int addNeighbor(pid_t npid, mqd_t queue)
+int addNeighbor(pid_t npid)
 {
-	if (node.neighborsCount + 1 > MAX_PEERS)
+	int i;
+
+	for (i = 0; i < node.neighborsCount; i++)
+		if (node.neighbors[i].pid == 0)
+			break;
+
+	if (i == MAX_PEERS)
 	{
-		printf("[%d] Too many neighbors\n", node.pid);
+		LOG(LOG_WARN, "[%d] Too many neighbors\n", node.pid);
 		return -1;
 	}
 
-	node.neighbors[node.neighborsCount] = createNeighbor(npid, queue);
+	node.neighbors[i] = createNeighbor(npid);
 
-	printf("[%d] Added neighbor: %d\n", node.pid, npid);
+	LOG(LOG_INFO, "[%d] Added neighbor: %d\n", node.pid, npid);
 	
-	return node.neighborsCount++;
+	if (i == node.neighborsCount)
+		node.neighborsCount++;
+	return i;
 }
 
+// Register a neighbor, its queue is opened when first needed
 int registerNeighbor(pid_t npid)
 {
-	mqd_t nqueue = openQueue(npid);
+	int known = neighborIndex(npid);
+	if (known != -1)
+		return known;
+
+	int nIndex = addNeighbor(npid);
 
-	int nIndex = addNeighbor(npid, nqueue);
+	if (nIndex != -1)
+		journalAppend(PEER, npid, NULL, 0);
 
 	return nIndex;
 }
@@ -156,8 +612,10 @@ void initializeNode()
 {
 	node.pid = getpid();
     node.neighborsCount = 0;
+    node.openQueues = 0;
+    node.lruHead = node.lruTail = -1;
 
-    printf("[%d] Initialized\n", node.pid);
+    LOG(LOG_INFO, "[%d] Initialized\n", node.pid);
 }
 
 void setQueueNotifier()
@@ -168,6 +626,90 @@ void setQueueNotifier()
     if (mq_notify(node.queue, &not) < 0) ERR("mq_notify");
 }
 
+// Send message to a neighbor through the outbox. If the neighbor's queue is full
+// the record stays pending and the send is retried by flushOutbox(), without
+// a journal (or with a full one) the message is dropped
+void sendToNeighbor(neighbor *n, message *msg, unsigned prio)
+{
+	uint32_t seq;
+	mqd_t queue;
+
+	if ((queue = neighborQueue(n)) == (mqd_t) -1)
+	{
+		STAT_ADD(node.stats->dropped, 1);
+		return;
+	}
+
+	seq = journalAppend(OUTBOX, n->pid, msg, prio);
+	msg->sent = monotonicNow();
+	if (TEMP_FAILURE_RETRY(mq_send(queue, (const char*) msg, sizeof(message), prio)))
+	{
+		if (errno != EAGAIN) ERR("mq_send");
+		STAT_ADD(n->stats->eagain, 1);
+		if (seq != 0)
+		{
+			LOG(LOG_WARN, "[%d] Queue of %d is full, message kept in outbox\n", node.pid, n->pid);
+			STAT_ADD(node.stats->outboxPending, 1);
+			if (node.stats->outboxPending > node.stats->outboxHighWater)
+				STAT_SET(node.stats->outboxHighWater, node.stats->outboxPending);
+			return;
+		}
+		LOG(LOG_WARN, "[%d] Queue of %d is full, message dropped\n", node.pid, n->pid);
+		STAT_ADD(node.stats->dropped, 1);
+		return;
+	}
+
+	STAT_ADD(n->stats->sent, 1);
+	STAT_ADD(node.stats->sent[msg->type], 1);
+	journalDone(seq);
+}
+
+// Retry pending outbox records, messages for peers which are gone are dropped
+void flushOutbox()
+{
+	uint32_t first, pending = 0;
+
+	if (!journal.header) return;
+
+	first = journal.header->count;
+	for (uint32_t i = journal.outboxFirst; i < journal.header->count; i++)
+	{
+		journalRecord *record = &journal.records[i];
+		neighbor *n;
+		mqd_t queue;
+
+		if (record->kind != OUTBOX || record->state != PENDING)
+			continue;
+
+		if ((n = findNeighbor(record->peer)) == NULL || (queue = neighborQueue(n)) == (mqd_t) -1)
+		{
+			record->state = DONE;
+			journalChanged();
+			STAT_ADD(node.stats->dropped, 1);
+			continue;
+		}
+
+		record->msg.sent = monotonicNow();
+		if (TEMP_FAILURE_RETRY(mq_send(queue, (const char*) &record->msg, sizeof(message), record->prio)))
+		{
+			if (errno != EAGAIN) ERR("mq_send");
+			STAT_ADD(n->stats->eagain, 1);
+			if (first == journal.header->count)
+				first = i;
+			pending++;
+			continue;
+		}
+
+		STAT_ADD(n->stats->sent, 1);
+		STAT_ADD(node.stats->sent[record->msg.type], 1);
+		record->state = DONE;
+		journalChanged();
+	}
+
+	journal.outboxFirst = first;
+	STAT_SET(node.stats->outboxPending, pending);
+}
+
 void sendTextMessage(pid_t last, pid_t from, pid_t to, char *content)
 {
 	message msg;
@@ -176,18 +718,20 @@ void sendTextMessage(pid_t last, pid_t from, pid_t to, char *content)
 	msg.to = to;
 	msg.type = TEXT;
 	strncpy(msg.content, content, MAX_MESSAGE_LENGTH);
-	mqd_t queue = neighborQueue(to);
+	neighbor *recipient = findNeighbor(to);
 
-	// queue = 0 means that there is no neighbor with that pid (send to all neighbors)
-	if (queue == 0)
+	// NULL means that there is no neighbor with that pid (send to all neighbors)
+	if (recipient == NULL)
 	{
+		STAT_ADD(node.stats->flooded, 1);
 		for (int i = 0; i < node.neighborsCount; i++)
-			if(node.neighbors[i].pid != last && node.neighbors[i].pid != from)
-				if (TEMP_FAILURE_RETRY(mq_send(node.neighbors[i].queue, (const char*) &msg, sizeof(message), 2))) ERR("mq_send");
+			if(node.neighbors[i].pid && node.neighbors[i].pid != last && node.neighbors[i].pid != from)
+				sendToNeighbor(&node.neighbors[i], &msg, 2);
 		return;
 	}
 
-	if (TEMP_FAILURE_RETRY(mq_send(queue, (const char*) &msg, sizeof(message), 2))) ERR("mq_send");
+	STAT_ADD(node.stats->forwarded, 1);
+	sendToNeighbor(recipient, &msg, 2);
 }
 
 // Send exit message to neighbors
@@ -199,10 +743,25 @@ void sendExitMessageToNeighbors(int receivedFrom)
 
 	for (int i = 0; i < node.neighborsCount; i++)
 	{
-		if (receivedFrom != node.neighbors[i].pid && checkProcess(node.neighbors[i].pid))
+		mqd_t queue;
+
+		if (node.neighbors[i].pid && receivedFrom != node.neighbors[i].pid && checkProcess(node.neighbors[i].pid)
+			&& (queue = neighborQueue(&node.neighbors[i])) != (mqd_t) -1)
 		{
-			printf("[%d] Sending exit message to %d\n", node.pid, node.neighbors[i].pid);
-			if (TEMP_FAILURE_RETRY(mq_send(node.neighbors[i].queue, (const char*) &msg, sizeof(message), 3))) ERR("mq_send");
+			LOG(LOG_INFO, "[%d] Sending exit message to %d\n", node.pid, node.neighbors[i].pid);
+			msg.sent = monotonicNow();
+			if (TEMP_FAILURE_RETRY(mq_send(queue, (const char*) &msg, sizeof(message), 3)))
+			{
+				// A full queue must not keep the rest of the network running
+				if (errno == EAGAIN)
+				{
+					STAT_ADD(node.neighbors[i].stats->eagain, 1);
+					continue;
+				}
+				ERR("mq_send");
+			}
+			STAT_ADD(node.neighbors[i].stats->sent, 1);
+			STAT_ADD(node.stats->sent[EXIT], 1);
 		}
 	}
 }
@@ -212,17 +771,69 @@ void cleanAndQuit()
 	mq_close(node.queue);
 	if (mq_unlink(node.queueName)) ERR("mq unlink");
 
-	for (int i = 0; i < node.neighborsCount; i++)
-		mq_close(node.neighbors[i].queue);
+	while (node.openQueues > 0)
+		closeNeighborQueue(node.lruHead);
+
+	if (journal.header)
+	{
+		stopJournalSyncer();
+		journalCommit(1);
+		munmap(journal.header, journal.size);
+	}
+
+	munmap(node.stats, sizeof(nodeStats));
+	if (shm_unlink(node.statsName)) ERR("shm_unlink");
 
-	printf("[%d] Terminating...\n", node.pid);
+	LOG(LOG_INFO, "[%d] Terminating...\n", node.pid);
 	exit(EXIT_SUCCESS);
 }
 
 void exitHandler(int sig)
 {
-	sendExitMessageToNeighbors(-1);
-	cleanAndQuit();
+	if (!exitFrom)
+		exitFrom = -1;
+}
+
+void handleMessage(message *rmsg, unsigned prio)
+{
+	uint32_t seq = journalAppend(INBOX, rmsg->from, rmsg, prio);
+
+	if (rmsg->type <= EXIT)
+		STAT_ADD(node.stats->received[rmsg->type], 1);
+	recordHopLatency(rmsg);
+
+	switch(rmsg->type)
+	{
+		case REGISTRATION:
+		{
+			LOG(LOG_INFO, "[%d] Received registration request, adding to neighbors...\n", node.pid);
+			registerNeighbor(rmsg->from);
+			//printNeighbors();
+		}
+		break;
+
+		case TEXT:
+		{
+			if (rmsg->to == node.pid || (node.previousPid && rmsg->to == node.previousPid))
+			{
+				STAT_ADD(node.stats->delivered, 1);
+				LOG(LOG_DEBUG, "[%d] Message from %d: %s\n", node.pid, rmsg->from, rmsg->content);
+			}
+			else
+				sendTextMessage(rmsg->last, rmsg->from, rmsg->to, rmsg->content);
+		}
+		break;
+
+		case EXIT:
+		{
+			LOG(LOG_INFO, "[%d] Received exit request, processing...\n", node.pid);
+			if (!exitFrom)
+				exitFrom = rmsg->from;
+		}
+		break;
+	}
+
+	journalDone(seq);
 }
 
 // Handler for receiving messages in own queue
@@ -230,10 +841,17 @@ void receivedMessageHandler(int sig)
 {
 	message rmsg;
 	unsigned msg_prio;
+	struct mq_attr attr;
+
+	// Depth of the queue as the notification found it
+	if (mq_getattr(node.queue, &attr)) ERR("mq_getattr");
+	if ((uint64_t) attr.mq_curmsgs > node.stats->queueHighWater)
+		STAT_SET(node.stats->queueHighWater, attr.mq_curmsgs);
 
 	setQueueNotifier();
 
-	while (1)
+	// Messages after an exit request are left in the queue, which is removed
+	while (!exitFrom)
 	{
         if (mq_receive(node.queue, (char*) &rmsg, sizeof(message), &msg_prio) < 1) 
         {
@@ -241,92 +859,214 @@ void receivedMessageHandler(int sig)
             else ERR("mq_receive");
         }
 
-        switch(rmsg.type)
-    	{
-    		case REGISTRATION:
-    		{
-    			printf("[%d] Received registration request, adding to neighbors...\n", node.pid);
-    			registerNeighbor(rmsg.from);
-    			//printNeighbors();
-    		}
-    		break;
-
-    		case TEXT:
-    		{
-    			if (rmsg.to == node.pid)
-    				printf("[%d] Message from %d: %s\n", node.pid, rmsg.from, rmsg.content);
-    			else
-    				sendTextMessage(rmsg.last, rmsg.from, rmsg.to, rmsg.content);
-    		}
-    		break;
-
-    		case EXIT:
-    		{
-    			printf("[%d] Received exit request, processing...\n", node.pid);
-    			sendExitMessageToNeighbors(rmsg.from);
-    			cleanAndQuit();
-    		}
-    		break;
-        }
+        handleMessage(&rmsg, msg_prio);
     }
+
+    flushOutbox();
+    journalCommit(0);
+}
+
+// Take over the queue left by the previous run of the node
+void drainStaleQueue(char *queueName)
+{
+	message rmsg;
+	unsigned msg_prio;
+	mqd_t queue;
+
+	if ((queue = TEMP_FAILURE_RETRY(mq_open(queueName, O_RDONLY | O_NONBLOCK))) == (mqd_t) -1)
+	{
+		if (errno == ENOENT) return;
+		ERR("mq_open");
+	}
+
+	while (mq_receive(queue, (char*) &rmsg, sizeof(message), &msg_prio) > 0)
+	{
+		// Exit requests were meant for the previous run
+		if (rmsg.type != EXIT)
+			handleMessage(&rmsg, msg_prio);
+	}
+	if (errno != EAGAIN) ERR("mq_receive");
+
+	mq_close(queue);
+	if (mq_unlink(queueName) && errno != ENOENT) ERR("mq unlink");
 }
 
-// Process's work
-void nodeWork()
+// Restore neighbors and undelivered traffic of the previous run
+void replayJournal()
+{
+	journalRecord *records = NULL;
+	uint32_t count = journal.header->count;
+	pid_t owner = journal.header->owner;
+	char queueName[50];
+
+	strcpy(queueName, journal.header->queueName);
+	if (count > 0)
+	{
+		if (NULL == (records = malloc(sizeof(journalRecord) * count))) ERR("malloc");
+		memcpy(records, journal.records, sizeof(journalRecord) * count);
+	}
+
+	journal.header->count = 0;
+	journal.header->owner = node.pid;
+	strcpy(journal.header->queueName, node.queueName);
+	journal.outboxFirst = 0;
+
+	if (owner != 0 && owner != node.pid)
+	{
+		LOG(LOG_INFO, "[%d] Replaying journal of %d (%u records)\n", node.pid, owner, count);
+		node.previousPid = owner;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (records[i].kind != PEER || neighborIndex(records[i].peer) != -1 || !checkProcess(records[i].peer))
+				continue;
+
+			int nIndex = registerNeighbor(records[i].peer);
+			if (nIndex != -1)
+				sendRegistrationMessage(&node.neighbors[nIndex]);
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (records[i].kind != OUTBOX || records[i].state != PENDING)
+				continue;
+			if (records[i].msg.last == owner)
+				records[i].msg.last = node.pid;
+			journalAppend(OUTBOX, records[i].peer, &records[i].msg, records[i].prio);
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+			if (records[i].kind == INBOX && records[i].state == PENDING)
+				handleMessage(&records[i].msg, records[i].prio);
+
+		if (queueName[0] && strcmp(queueName, node.queueName))
+			drainStaleQueue(queueName);
+
+		flushOutbox();
+	}
+
+	free(records);
+	journalCommit(1);
+}
+
+// Process's work. SIGINT and SIGRTMIN are blocked outside ppoll, so their
+// handlers run between whole steps of the loop and never inside a send.
+void nodeWork(sigset_t *waitMask)
 {
 	char buf[50];
 	pid_t npid;
 	char content[MAX_MESSAGE_LENGTH];
+	struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+	int eof = 0;
 
-	// Wait for stdin
-	while (1) 
+	while (!exitFrom)
 	{
-		if (read(STDIN_FILENO, buf, sizeof(buf)) < 0)
+		// End of input, keep serving the queue only
+		if (ppoll(&input, eof ? 0 : 1, NULL, waitMask) < 0)
 		{
-			if(errno == EINTR)
-			{
-				//printf("[%d] Reading interrupted\n", node.pid);
-				continue;
-			}
+			if (errno == EINTR) continue;
+			ERR("ppoll");
+		}
+
+		ssize_t count = read(STDIN_FILENO, buf, sizeof(buf) - 1);
+		if (count < 0)
+			continue;
+		if (count == 0)
+		{
+			eof = 1;
+			continue;
 		}
+		buf[count] = '\0';
 
 		sscanf(buf, "%d %"MAX_MESSAGE_LENGTH_STR"[^\n]c", (int*) &npid, content);
 
 		if (checkProcess(npid))
 			sendTextMessage(node.pid, node.pid, npid, content);
 		else
-			printf("[%d] There is no process with PID %d\n", node.pid, npid);
+		{
+			STAT_ADD(node.stats->dropped, 1);
+			LOG(LOG_WARN, "[%d] There is no process with PID %d\n", node.pid, npid);
+		}
+		flushOutbox();
+		journalCommit(0);
 	}
+
+	sendExitMessageToNeighbors(exitFrom);
+	cleanAndQuit();
 }
 
 int main(int argc, char **argv) 
 {
-    if (argc > 2) usage(argv[0]);
+    char *journalPath = NULL;
+    sigset_t mask, oldmask;
+    int c;
 
+    journal.group = JOURNAL_GROUP_COMMIT;
+    journal.syncMs = JOURNAL_SYNC_MS;
+    node.maxOpenQueues = MAX_OPEN_QUEUES;
+    while ((c = getopt(argc, argv, "j:s:g:q:")) != -1)
+    {
+    	switch (c)
+    	{
+    		case 'j':
+    			journalPath = optarg;
+    			break;
+    		case 's':
+    			journal.syncMs = atol(optarg);
+    			break;
+    		case 'g':
+    			journal.group = atoi(optarg);
+    			break;
+    		case 'q':
+    			node.maxOpenQueues = atoi(optarg);
+    			break;
+    		default:
+    			usage(argv[0]);
+    	}
+    }
+    if (argc - optind > 1 || journal.syncMs < 1 || (int) journal.group < 0
+    	|| node.maxOpenQueues < 1 || node.maxOpenQueues > MAX_PEERS) usage(argv[0]);
+
+    log_init();
     initializeNode();
     initializeQueue();
+    initializeStats();
+    if (journalPath)
+    {
+    	openJournal(journalPath);
+    	startJournalSyncer();
+    }
 	
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGRTMIN);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
     sethandler(exitHandler, SIGINT);
     sethandler(receivedMessageHandler, SIGRTMIN);
     setQueueNotifier();
 
-    if (argc == 2)
+    if (journal.header)
+    	replayJournal();
+
+    if (optind < argc)
     {
-    	int neighbor = atoi(argv[1]);
+    	int neighbor = atoi(argv[optind]);
 
     	if (checkProcess(neighbor))
 	    {
 	    	int nIndex = registerNeighbor(neighbor);
 	    	if (nIndex != -1)
-	    		sendRegistrationMessage(node.neighbors[nIndex].queue);
+	    		sendRegistrationMessage(&node.neighbors[nIndex]);
 	    } 
 	    else 
 	    {
-	    	printf("[%d] There is no process with PID %d\n", node.pid, neighbor);
+	    	LOG(LOG_WARN, "[%d] There is no process with PID %d\n", node.pid, neighbor);
 	    }
     }
 
-    nodeWork();
+    journalCommit(0);
+
+    nodeWork(&oldmask);
 
     return EXIT_SUCCESS;
 }
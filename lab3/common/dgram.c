@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "dgram.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+void batch_init(datagram_batch *batch, int size, size_t datagram_max)
+{
+    batch->count = 0;
+    batch->size = size;
+    batch->datagram_max = datagram_max;
+    if (NULL == (batch->data = malloc(size * datagram_max)) ||
+        NULL == (batch->addr = calloc(size, sizeof(struct sockaddr_in))) ||
+        NULL == (batch->iov = calloc(size, sizeof(struct iovec))) ||
+        NULL == (batch->msgs = calloc(size, sizeof(struct mmsghdr))))
+        ERR("malloc");
+    for (int i = 0; i < size; i++)
+    {
+        batch->iov[i].iov_base = batch_data(batch, i);
+        batch->iov[i].iov_len = datagram_max;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+    }
+}
+
+void batch_free(datagram_batch *batch)
+{
+    free(batch->data);
+    free(batch->addr);
+    free(batch->iov);
+    free(batch->msgs);
+}
+
+int receive_batch(int fd, datagram_batch *batch)
+{
+    int n;
+
+    for (int i = 0; i < batch->size; i++)
+    {
+        batch->iov[i].iov_len = batch->datagram_max;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    // ECONNREFUSED reports an earlier datagram of a connected socket
+    if ((n = recvmmsg(fd, batch->msgs, batch->size, MSG_DONTWAIT, NULL)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+            n = 0;
+        else
+            ERR("recvmmsg");
+    }
+    batch->count = n;
+    return n;
+}
+
+void batch_queue(datagram_batch *batch, struct sockaddr_in *addr, const void *data, size_t len)
+{
+    memcpy(batch_data(batch, batch->count), data, len);
+    batch->iov[batch->count].iov_len = len;
+    batch->addr[batch->count] = *addr;
+    batch->msgs[batch->count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->count++;
+}
+
+int flush_batch(int fd, datagram_batch *batch)
+{
+    int done = 0, sent = 0, n;
+
+    while (done < batch->count)
+    {
+        if ((n = sendmmsg(fd, batch->msgs + done, batch->count - done, 0)) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            if (ECONNREFUSED == errno || ECONNRESET == errno || EAGAIN == errno || ENOBUFS == errno)
+            {
+                // Skip the datagram that failed
+                batch->msgs[done++].msg_len = 0;
+                continue;
+            }
+            ERR("sendmmsg");
+        }
+        done += n;
+        sent += n;
+    }
+    batch->count = 0;
+    return sent;
+}
+
+int same_address(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+uint32_t address_hash(struct sockaddr_in *addr)
+{
+    uint64_t key = ((uint64_t) addr->sin_addr.s_addr << 16) | addr->sin_port;
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
@@ -0,0 +1,43 @@
+#ifndef DGRAM_H
+#define DGRAM_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Batches of UDP datagrams moved with one recvmmsg/sendmmsg
+
+typedef struct datagram_batch
+{
+    int count; // datagrams received or queued
+    int size; // capacity
+    size_t datagram_max;
+    char *data; // size buffers of datagram_max bytes
+    struct sockaddr_in *addr;
+    struct iovec *iov;
+    struct mmsghdr *msgs;
+} datagram_batch;
+
+void batch_init(datagram_batch *batch, int size, size_t datagram_max);
+void batch_free(datagram_batch *batch);
+
+static inline char *batch_data(datagram_batch *batch, int i)
+{
+    return batch->data + i * batch->datagram_max;
+}
+
+// Receive up to size datagrams without blocking, returns how many came
+int receive_batch(int fd, datagram_batch *batch);
+
+// Queue a datagram for the next flush_batch, the batch must not be full
+void batch_queue(datagram_batch *batch, struct sockaddr_in *addr, const void *data, size_t len);
+
+// Send all queued datagrams. One refused by the peer or by a full socket
+// buffer is dropped, as UDP may do anyway, and its msg_len is left 0.
+// Returns how many were sent.
+int flush_batch(int fd, datagram_batch *batch);
+
+int same_address(struct sockaddr_in *a, struct sockaddr_in *b);
+uint32_t address_hash(struct sockaddr_in *addr);
+
+#endif
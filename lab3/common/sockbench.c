@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sockio.h"
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(exp) ({ \
+   typeof (exp) _rc; \
+   do { \
+     _rc = (exp); \
+   } while (_rc == -1 && errno == EINTR); \
+   _rc; })
+#endif
+
+#define DEFAULT_FRAMES 200000
+#define DEFAULT_PAYLOAD 56
+#define MAX_PAYLOAD 65536
+#define HEADER_SIZE 8
+
+// Sends frames of a header and a payload between two processes and counts
+// syscalls on both ends, once with the loops the lab3 programs used to copy
+// around (read/write per buffer) and once with sockio.
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-n frames] [-s payload]\n", name);
+    fprintf(stderr, "frames - frames per run (default %d)\n", DEFAULT_FRAMES);
+    fprintf(stderr, "payload - bytes after the %d byte header (default %d, max %d)\n", HEADER_SIZE, DEFAULT_PAYLOAD,
+            MAX_PAYLOAD);
+}
+
+double monotonic_s()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The old copy-pasted loops, counting their syscalls in sockio_stats
+ssize_t plain_read(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do
+    {
+        sockio_stats.reads++;
+        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0)
+            return c;
+        if (0 == c)
+            return len;
+        sockio_stats.bytes_read += c;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+ssize_t plain_write(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do
+    {
+        sockio_stats.writes++;
+        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0)
+            return c;
+        sockio_stats.bytes_written += c;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+void transfer(int fd, int writer, int vectored, long frames, size_t payload)
+{
+    static char header[HEADER_SIZE], body[MAX_PAYLOAD];
+    struct iovec iov[2] = {{header, HEADER_SIZE}, {body, payload}};
+    ssize_t size = HEADER_SIZE + payload, c;
+
+    for (long i = 0; i < frames; i++)
+    {
+        if (writer && vectored)
+            c = bulk_writev(fd, iov, 2);
+        else if (writer)
+            c = plain_write(fd, header, HEADER_SIZE) < 0 ? -1 : plain_write(fd, body, payload) + HEADER_SIZE;
+        else if (vectored)
+            c = bulk_readv(fd, iov, 2);
+        else
+            c = plain_read(fd, header, HEADER_SIZE) < HEADER_SIZE ? -1 : plain_read(fd, body, payload) + HEADER_SIZE;
+        if (c != size)
+            ERR(writer ? "write" : "read");
+    }
+}
+
+void report(char *transport, char *method, char *end, double seconds, long frames, uint64_t calls, uint64_t bytes)
+{
+    printf("%-6s %-6s %-6s %10.0f frames/s %8.1f MB/s %8.2f syscalls/frame %8.1f bytes/syscall\n", transport, method,
+           end, frames / seconds, bytes / seconds / 1e6, (double) calls / frames, calls ? (double) bytes / calls : 0);
+}
+
+// Connected pair of stream sockets, over TCP loopback or a socketpair
+void make_pair(int tcp, int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    char port[16];
+    int listen_fd;
+
+    if (!tcp)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+            ERR("socketpair");
+        return;
+    }
+    listen_fd = bind_inet_socket(0, SOCK_STREAM, 1, 0);
+    if (getsockname(listen_fd, (struct sockaddr *) &addr, &size))
+        ERR("getsockname");
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    fds[1] = connect_socket("127.0.0.1", port, SOCK_STREAM);
+    if ((fds[0] = TEMP_FAILURE_RETRY(accept(listen_fd, NULL, NULL))) < 0)
+        ERR("accept");
+    if (TEMP_FAILURE_RETRY(close(listen_fd)) < 0)
+        ERR("close");
+}
+
+void run(int tcp, int vectored, long frames, size_t payload)
+{
+    char *transport = tcp ? "tcp" : "unix", *method = vectored ? "sockio" : "plain";
+    int fds[2];
+    double start;
+    pid_t pid;
+
+    make_pair(tcp, fds);
+    fflush(stdout);
+    start = monotonic_s();
+    if ((pid = fork()) < 0)
+        ERR("fork");
+    if (0 == pid)
+    {
+        if (TEMP_FAILURE_RETRY(close(fds[0])) < 0)
+            ERR("close");
+        memset(&sockio_stats, 0, sizeof(sockio_stats));
+        transfer(fds[1], 1, vectored, frames, payload);
+        report(transport, method, "writer", monotonic_s() - start, frames, sockio_stats.writes,
+               sockio_stats.bytes_written);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (TEMP_FAILURE_RETRY(close(fds[1])) < 0)
+        ERR("close");
+    memset(&sockio_stats, 0, sizeof(sockio_stats));
+    transfer(fds[0], 0, vectored, frames, payload);
+    if (TEMP_FAILURE_RETRY(waitpid(pid, NULL, 0)) < 0)
+        ERR("waitpid");
+    report(transport, method, "reader", monotonic_s() - start, frames, sockio_stats.reads, sockio_stats.bytes_read);
+    if (TEMP_FAILURE_RETRY(close(fds[0])) < 0)
+        ERR("close");
+}
+
+int main(int argc, char **argv)
+{
+    long frames = DEFAULT_FRAMES;
+    long payload = DEFAULT_PAYLOAD;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                frames = atol(optarg);
+                break;
+            case 's':
+                payload = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc != optind || frames < 1 || payload < 0 || payload > MAX_PAYLOAD)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int tcp = 0; tcp <= 1; tcp++)
+        for (int vectored = 0; vectored <= 1; vectored++)
+            run(tcp, vectored, frames, payload);
+    return EXIT_SUCCESS;
+}
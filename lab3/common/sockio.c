@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "sockio.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(exp) ({ \
+   typeof (exp) _rc; \
+   do { \
+     _rc = (exp); \
+   } while (_rc == -1 && errno == EINTR); \
+   _rc; })
+#endif
+
+#define ADDRESS_CACHE 8
+#define MAX_IOV 16 // buffers of one bulk_readv/bulk_writev
+
+__thread sockio_counters sockio_stats;
+
+int make_socket(int domain, int type)
+{
+    int sock;
+    sock = socket(domain, type, 0);
+    if (sock < 0)
+        ERR("socket");
+    return sock;
+}
+
+int bind_inet_socket(uint16_t port, int type, int backlog, int reuse_port)
+{
+    struct sockaddr_in addr;
+    int socketfd, t = 1;
+    socketfd = make_socket(PF_INET, type);
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (reuse_port && setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        ERR("bind");
+    if (SOCK_STREAM == (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)))
+        if (listen(socketfd, backlog) < 0)
+            ERR("listen");
+    return socketfd;
+}
+
+static struct sockaddr_un local_address(char *name)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+int bind_local_socket(char *name, int type, int backlog)
+{
+    struct sockaddr_un addr = local_address(name);
+    int socketfd;
+    if (unlink(name) < 0 && errno != ENOENT)
+        ERR("unlink");
+    socketfd = make_socket(PF_UNIX, type);
+    if (bind(socketfd, (struct sockaddr *)&addr, SUN_LEN(&addr)) < 0)
+        ERR("bind");
+    if (SOCK_STREAM == (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)))
+        if (listen(socketfd, backlog) < 0)
+            ERR("listen");
+    return socketfd;
+}
+
+struct sockaddr_in make_address(char *address, char *port)
+{
+    static __thread struct
+    {
+        char address[NI_MAXHOST], port[NI_MAXSERV];
+        struct sockaddr_in addr;
+    } cache[ADDRESS_CACHE];
+    static __thread int cached;
+    int ret, i;
+    struct sockaddr_in addr;
+    struct addrinfo *result;
+    struct addrinfo hints = {};
+
+    for (i = 0; i < cached; i++)
+        if (!strcmp(cache[i].address, address) && !strcmp(cache[i].port, port))
+            return cache[i].addr;
+
+    hints.ai_family = AF_INET;
+    if ((ret = getaddrinfo(address, port, &hints, &result)))
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    addr = *(struct sockaddr_in *)(result->ai_addr);
+    freeaddrinfo(result);
+
+    // The oldest entry goes when the cache is full
+    if (cached == ADDRESS_CACHE)
+    {
+        memmove(cache, cache + 1, sizeof(cache[0]) * (ADDRESS_CACHE - 1));
+        cached--;
+    }
+    i = cached++;
+    snprintf(cache[i].address, sizeof(cache[i].address), "%s", address);
+    snprintf(cache[i].port, sizeof(cache[i].port), "%s", port);
+    cache[i].addr = addr;
+    return addr;
+}
+
+// A connect interrupted by a signal goes on in the background, wait for it
+static int connect_address(int domain, int type, struct sockaddr *addr, socklen_t len)
+{
+    int socketfd;
+    socketfd = make_socket(domain, type);
+    if (connect(socketfd, addr, len) < 0)
+    {
+        if (errno != EINTR)
+            ERR("connect");
+        else
+        {
+            struct pollfd pfd = {socketfd, POLLOUT, 0};
+            int status;
+            socklen_t size = sizeof(int);
+            if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0)
+                ERR("poll");
+            if (getsockopt(socketfd, SOL_SOCKET, SO_ERROR, &status, &size) < 0)
+                ERR("getsockopt");
+            if (0 != status)
+                ERR("connect");
+        }
+    }
+    return socketfd;
+}
+
+int connect_socket(char *name, char *port, int type)
+{
+    struct sockaddr_in addr = make_address(name, port);
+    return connect_address(PF_INET, type, (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
+}
+
+int connect_local_socket(char *name, int type)
+{
+    struct sockaddr_un addr = local_address(name);
+    return connect_address(PF_UNIX, type, (struct sockaddr *)&addr, SUN_LEN(&addr));
+}
+
+static int wait_for(int fd, short events)
+{
+    struct pollfd pfd = {fd, events, 0};
+    return TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0 ? -1 : 0;
+}
+
+// Reads into iov until it is full or EOF, iov is consumed as it fills
+static ssize_t read_all(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {0};
+    ssize_t c;
+    size_t len = 0;
+    int sock = 1;
+
+    while (iovcnt > 0)
+    {
+        sockio_stats.reads++;
+        if (sock)
+        {
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            c = recvmsg(fd, &msg, MSG_WAITALL);
+            if (c < 0 && ENOTSOCK == errno)
+            {
+                sock = 0;
+                continue;
+            }
+        }
+        else
+            c = readv(fd, iov, iovcnt);
+        if (c < 0 && EINTR == errno)
+            continue;
+        if (c < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            if (wait_for(fd, POLLIN))
+                return -1;
+            continue;
+        }
+        if (c < 0)
+            return c;
+        if (0 == c)
+            break;
+        sockio_stats.bytes_read += c;
+        len += c;
+        for (; iovcnt > 0 && (size_t) c >= iov->iov_len; iov++, iovcnt--)
+            c -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + c;
+            iov->iov_len -= c;
+        }
+    }
+    return len;
+}
+
+static ssize_t write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t c;
+    size_t len = 0;
+
+    while (iovcnt > 0)
+    {
+        sockio_stats.writes++;
+        c = writev(fd, iov, iovcnt);
+        if (c < 0 && EINTR == errno)
+            continue;
+        if (c < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            if (wait_for(fd, POLLOUT))
+                return -1;
+            continue;
+        }
+        if (c < 0)
+            return c;
+        sockio_stats.bytes_written += c;
+        len += c;
+        for (; iovcnt > 0 && (size_t) c >= iov->iov_len; iov++, iovcnt--)
+            c -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + c;
+            iov->iov_len -= c;
+        }
+    }
+    return len;
+}
+
+ssize_t bulk_read(int fd, char *buf, size_t count)
+{
+    struct iovec iov = {buf, count};
+    return read_all(fd, &iov, 1);
+}
+
+ssize_t bulk_write(int fd, char *buf, size_t count)
+{
+    struct iovec iov = {buf, count};
+    return write_all(fd, &iov, 1);
+}
+
+ssize_t bulk_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec copy[MAX_IOV];
+
+    if (iovcnt > MAX_IOV)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+    return read_all(fd, copy, iovcnt);
+}
+
+ssize_t bulk_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec copy[MAX_IOV];
+
+    if (iovcnt > MAX_IOV)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+    return write_all(fd, copy, iovcnt);
+}
+
+int frame_read(int fd, void *frame, size_t size, size_t *filled)
+{
+    ssize_t c;
+
+    do
+    {
+        sockio_stats.reads++;
+        c = recv(fd, (char *) frame + *filled, size - *filled, MSG_DONTWAIT);
+    } while (c < 0 && EINTR == errno);
+    if (c < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+        return 0;
+    if (c < 0)
+        return -1;
+    if (0 == c)
+    {
+        errno = 0;
+        return -1;
+    }
+    sockio_stats.bytes_read += c;
+    if ((*filled += c) < size)
+        return 0;
+    *filled = 0;
+    return 1;
+}
+
+ssize_t frame_write(int fd, const void *frame, size_t size)
+{
+    ssize_t c;
+
+    do
+    {
+        sockio_stats.writes++;
+        c = send(fd, frame, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (c < 0 && EINTR == errno);
+    if (c < 0)
+        return c;
+    sockio_stats.bytes_written += c;
+    if ((size_t) c < size)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return c;
+}
@@ -0,0 +1,54 @@
+#ifndef SOCKIO_H
+#define SOCKIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+// Socket helpers shared by the lab3 programs. Functions that set up sockets
+// end the program on failure (ERR), I/O functions return -1 with errno set.
+
+typedef struct sockio_counters
+{
+    uint64_t reads, writes; // syscalls, EAGAIN included
+    uint64_t bytes_read, bytes_written;
+} sockio_counters;
+
+// Per thread, for the benchmark and for anyone curious about bytes per syscall
+extern __thread sockio_counters sockio_stats;
+
+int make_socket(int domain, int type);
+
+// backlog is used by SOCK_STREAM only, reuse_port sets SO_REUSEPORT
+int bind_inet_socket(uint16_t port, int type, int backlog, int reuse_port);
+
+// Removes a stale socket file first
+int bind_local_socket(char *name, int type, int backlog);
+
+// IPv4 address of a host and port. Results are cached per thread, so asking
+// again for the same pair costs no getaddrinfo.
+struct sockaddr_in make_address(char *address, char *port);
+
+int connect_socket(char *name, char *port, int type);
+int connect_local_socket(char *name, int type);
+
+// Read or write all count bytes, short only at EOF. Sockets are read with
+// MSG_WAITALL, so a whole frame usually takes one syscall. On a non-blocking
+// descriptor EAGAIN waits in poll instead of spinning.
+ssize_t bulk_read(int fd, char *buf, size_t count);
+ssize_t bulk_write(int fd, char *buf, size_t count);
+
+// The same for several buffers in one syscall. iov is not modified.
+ssize_t bulk_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t bulk_writev(int fd, const struct iovec *iov, int iovcnt);
+
+// Non-blocking framing for event loops. frame_read adds what has arrived to
+// a frame of size bytes, *filled bytes of which are already there. Returns 1
+// once the frame is complete (and resets *filled), 0 if more is needed, -1
+// at EOF (errno 0) or on error. frame_write sends a whole frame or fails with
+// EAGAIN, so that a peer that does not read cannot stall the loop.
+int frame_read(int fd, void *frame, size_t size, size_t *filled);
+ssize_t frame_write(int fd, const void *frame, size_t size);
+
+#endif
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include "wheel.h"
+
+uint64_t current_tick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000L + now.tv_nsec) / WHEEL_TICK_NS;
+}
+
+void wheel_init(timer_wheel *wheel)
+{
+    memset(wheel, 0, sizeof(timer_wheel));
+    wheel->now = current_tick();
+}
+
+void timer_init(timer *t)
+{
+    t->level = -1;
+    t->prev = t->next = NULL;
+}
+
+static void wheel_insert(timer_wheel *wheel, timer *t)
+{
+    int level = 0, top = WHEEL_BITS * (WHEEL_LEVELS - 1);
+
+    if (t->expires <= wheel->now)
+        t->expires = wheel->now + 1;
+    if ((t->expires >> top) - (wheel->now >> top) > WHEEL_SIZE)
+        t->expires = ((wheel->now >> top) + WHEEL_SIZE) << top;
+
+    // Level whose slot is cascaded (or fired) within the next revolution
+    if (t->expires - wheel->now >= WHEEL_SIZE)
+        for (level = 1; level < WHEEL_LEVELS - 1; level++)
+            if ((t->expires >> (WHEEL_BITS * level)) - (wheel->now >> (WHEEL_BITS * level)) <= WHEEL_SIZE)
+                break;
+
+    t->level = level;
+    t->slot = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    t->prev = NULL;
+    t->next = wheel->slots[level][t->slot];
+    if (t->next)
+        t->next->prev = t;
+    wheel->slots[level][t->slot] = t;
+}
+
+void timer_del(timer_wheel *wheel, timer *t)
+{
+    if (t->level < 0)
+        return;
+
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wheel->slots[t->level][t->slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->level = -1;
+    t->prev = t->next = NULL;
+    wheel->count--;
+}
+
+void timer_add(timer_wheel *wheel, timer *t, long ms)
+{
+    uint64_t now = current_tick();
+
+    timer_del(wheel, t);
+    if (wheel->count == 0)
+        wheel->now = now;
+    t->expires = now + (ms * 1000000L + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    wheel_insert(wheel, t);
+    wheel->count++;
+}
+
+// Move timers of a higher level slot to lower levels
+static void wheel_cascade(timer_wheel *wheel, int level, int slot)
+{
+    timer *t = wheel->slots[level][slot], *next;
+
+    wheel->slots[level][slot] = NULL;
+    for (; t; t = next)
+    {
+        next = t->next;
+        wheel_insert(wheel, t);
+    }
+}
+
+timer *wheel_advance(timer_wheel *wheel, uint64_t tick)
+{
+    timer *expired = NULL, *t, *next;
+
+    if (wheel->count == 0 && tick > wheel->now)
+        wheel->now = tick;
+
+    while (wheel->now < tick)
+    {
+        wheel->now++;
+
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if (wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_cascade(wheel, level, (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+        t = wheel->slots[0][wheel->now & WHEEL_MASK];
+        wheel->slots[0][wheel->now & WHEEL_MASK] = NULL;
+        for (; t; t = next)
+        {
+            next = t->next;
+            t->level = -1;
+            t->prev = NULL;
+            t->next = expired;
+            expired = t;
+            wheel->count--;
+        }
+    }
+
+    return expired;
+}
+
+long wheel_timeout(timer_wheel *wheel)
+{
+    uint64_t now = current_tick(), next = UINT64_MAX, base;
+    timer *t;
+
+    if (wheel->count == 0)
+        return -1;
+
+    // The first non-empty slot of each level holds its nearest timers. Timers
+    // of a higher level slot may expire anywhere in its span, so take the
+    // earliest of them instead of waking up for the cascade.
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        base = wheel->now >> (WHEEL_BITS * level);
+        for (int i = 1; i <= WHEEL_SIZE; i++)
+        {
+            if (!(t = wheel->slots[level][(base + i) & WHEEL_MASK]))
+                continue;
+            for (; t; t = t->next)
+                if (t->expires < next)
+                    next = t->expires;
+            break;
+        }
+    }
+
+    return next > now ? (next - now) * WHEEL_TICK_NS / 1000000L : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Hierarchical timer wheel shared by the lab3 UDP programs
+
+#define WHEEL_TICK_NS 1000000L // 1 ms
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 3 // 2^24 ticks, longer timers are clamped
+
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+// Embedded in the object it times, container_of gets the object back
+typedef struct timer
+{
+    uint64_t expires; // tick
+    int level, slot; // -1 level when not armed
+    struct timer *prev, *next;
+} timer;
+
+// Level 0 slots are single ticks, every slot of the next level spans a whole
+// revolution of the previous one and is cascaded down when the lower level
+// wraps
+typedef struct timer_wheel
+{
+    uint64_t now; // last processed tick
+    int count;
+    timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timer_wheel;
+
+uint64_t current_tick(void);
+
+void wheel_init(timer_wheel *wheel);
+void timer_init(timer *t);
+
+// Arm (or re-arm) timer to fire after ms milliseconds
+void timer_add(timer_wheel *wheel, timer *t, long ms);
+void timer_del(timer_wheel *wheel, timer *t);
+
+// Advance the wheel up to tick, returns the expired timers linked through next
+timer *wheel_advance(timer_wheel *wheel, uint64_t tick);
+
+// Milliseconds to the earliest expiry, -1 if no timer is armed
+long wheel_timeout(timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,701 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <netdb.h>
+#include <math.h>
+#include <time.h>
+#include <stddef.h>
+#include "sockio.h"
+#include "wheel.h"
+#include "dgram.h"
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(exp) ({ \
+   typeof (exp) _rc; \
+   do { \
+     _rc = (exp); \
+   } while (_rc == -1 && errno == EINTR); \
+   _rc; })
+#endif
+
+#define MAX_FLOWS 4096 // clients relayed at once
+#define DEFAULT_FLOW_IDLE 30 // s without datagrams before a flow is closed
+#define FLOW_INDEX_SIZE (2 * MAX_FLOWS) // power of two
+#define MAX_PACKETS 8192 // datagrams held back at once
+#define MAX_DATAGRAM 2048
+#define MAX_EVENTS 64
+#define BATCH_SIZE 64 // datagrams per recvmmsg/sendmmsg
+#define LATENCY_BUCKETS 32 // bucket i counts exchanges taking [2^(i-1), 2^i) us
+
+#define UPSTREAM 0 // client to server
+#define DOWNSTREAM 1 // server to client
+
+// Impairments applied to every datagram in both directions
+typedef struct link_config
+{
+    double loss, duplicate, reorder; // probabilities
+    double loss_step; // added to loss every second
+    long delay, jitter; // ms
+    int exponential; // jitter distribution, uniform [-jitter, jitter] by default
+    long reorder_delay; // extra ms holding a reordered datagram back
+} link_config;
+
+typedef struct link_stats
+{
+    long packets[2], dropped[2], duplicated[2], reordered[2]; // by direction
+    long bytes[2]; // delivered
+    long completions;
+    uint64_t latency_sum; // us
+    long latency[LATENCY_BUCKETS];
+} link_stats;
+
+// A client and the socket relaying its datagrams to the server, so the
+// server sees one address per client
+typedef struct flow
+{
+    struct sockaddr_in addr;
+    int fd;
+    uint64_t pending_since; // us, first datagram of an unanswered exchange, 0 - none
+    uint64_t active; // tick of the last datagram
+    int held; // packets of the flow in the wheel
+    timer idle; // checks whether the flow went idle
+    link_stats stats;
+} flow;
+
+typedef struct packet
+{
+    timer timer;
+    uint64_t seq; // arrival order, ties between equal expiry ticks
+    flow *flow;
+    int direction;
+    int len;
+    char data[MAX_DATAGRAM];
+} packet;
+
+typedef struct relay
+{
+    int fd; // clients talk to this socket
+    int epfd;
+    struct sockaddr_in server;
+    link_config link;
+    timer_wheel wheel;
+    timer_wheel flow_wheel; // idle timers of the flows
+    uint64_t tick; // taken once per loop
+    packet *packets;
+    timer *free_packets; // linked through next
+    uint64_t seq;
+    long overflows; // datagrams dropped because all packets were held
+    flow flows[MAX_FLOWS]; // fd -1 - free slot
+    int32_t index[FLOW_INDEX_SIZE];
+    int flow_count; // slots ever used
+    int32_t free_flows[MAX_FLOWS]; // slots of closed flows
+    int free_count;
+    long flow_idle; // ms
+    long refused; // datagrams of new clients dropped, all flows open
+    long truncated; // datagrams dropped, longer than MAX_DATAGRAM
+    long closed_count;
+    link_stats closed; // flows closed when idle
+    link_stats interval; // since the last report
+    datagram_batch in, out;
+} relay;
+
+volatile sig_atomic_t do_work = 1;
+
+void sigint_handler(int sig)
+{
+    do_work = 0;
+}
+
+int sethandler(void (*f)(int), int sigNo)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = f;
+    if (-1 == sigaction(sigNo, &act, NULL))
+        return -1;
+    return 0;
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-l loss] [-i step] [-d delay] [-j jitter] [-e] [-o reorder] [-g gap] [-u duplicate] "
+                    "[-f idle] [-t seconds] port server_domain server_port\n", name);
+    fprintf(stderr, "-l - datagrams lost, percent\n");
+    fprintf(stderr, "-i - loss added every second, percent\n");
+    fprintf(stderr, "-d - one way delay, ms\n");
+    fprintf(stderr, "-j - delay jitter, ms, uniform [-jitter, jitter] or exponential mean with -e\n");
+    fprintf(stderr, "-o - datagrams held back by gap ms, percent\n");
+    fprintf(stderr, "-g - reordering gap, ms (default delay + jitter + 1)\n");
+    fprintf(stderr, "-u - datagrams duplicated, percent\n");
+    fprintf(stderr, "-f - seconds without datagrams before a client is forgotten (default %d)\n", DEFAULT_FLOW_IDLE);
+    fprintf(stderr, "-t - relay lifetime\n");
+}
+
+uint64_t monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+}
+
+// The wheel does not keep the order of timers, sort expired packets by
+// expiry and arrival so datagrams with equal delays leave in order
+timer *sort_expired(timer *list)
+{
+    timer *a = NULL, *b = NULL, *next, head, *tail = &head;
+    packet *pa, *pb;
+
+    if (!list || !list->next)
+        return list;
+
+    // Split, then merge sorted halves
+    for (int i = 0; list; list = next, i++)
+    {
+        next = list->next;
+        if (i & 1)
+        {
+            list->next = b;
+            b = list;
+        }
+        else
+        {
+            list->next = a;
+            a = list;
+        }
+    }
+    a = sort_expired(a);
+    b = sort_expired(b);
+
+    while (a && b)
+    {
+        pa = container_of(a, packet, timer);
+        pb = container_of(b, packet, timer);
+        if (pa->timer.expires < pb->timer.expires || (pa->timer.expires == pb->timer.expires && pa->seq < pb->seq))
+        {
+            tail->next = a;
+            a = a->next;
+        }
+        else
+        {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
+// Flow of a client, a new one gets its own socket connected to the server
+flow *flow_get(relay *r, struct sockaddr_in *addr)
+{
+    struct epoll_event event;
+    uint32_t i;
+    int32_t slot;
+    flow *f;
+
+    for (i = address_hash(addr) & (FLOW_INDEX_SIZE - 1); r->index[i] >= 0; i = (i + 1) & (FLOW_INDEX_SIZE - 1))
+        if (same_address(&r->flows[r->index[i]].addr, addr))
+            return &r->flows[r->index[i]];
+
+    if (r->free_count)
+        slot = r->free_flows[--r->free_count];
+    else if (r->flow_count < MAX_FLOWS)
+        slot = r->flow_count++;
+    else
+        return NULL;
+
+    f = &r->flows[slot];
+    memset(f, 0, sizeof(flow));
+    f->addr = *addr;
+    f->fd = make_socket(PF_INET, SOCK_DGRAM);
+    if (connect(f->fd, (struct sockaddr *) &r->server, sizeof(r->server)) < 0)
+        ERR("connect");
+    event.events = EPOLLIN;
+    event.data.ptr = f;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, f->fd, &event) < 0)
+        ERR("epoll_ctl");
+    f->active = r->tick;
+    timer_init(&f->idle);
+    timer_add(&r->flow_wheel, &f->idle, r->flow_idle);
+    r->index[i] = slot;
+    return f;
+}
+
+void add_stats(link_stats *sum, link_stats *s)
+{
+    for (int d = UPSTREAM; d <= DOWNSTREAM; d++)
+    {
+        sum->packets[d] += s->packets[d];
+        sum->dropped[d] += s->dropped[d];
+        sum->duplicated[d] += s->duplicated[d];
+        sum->reordered[d] += s->reordered[d];
+        sum->bytes[d] += s->bytes[d];
+    }
+    sum->completions += s->completions;
+    sum->latency_sum += s->latency_sum;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        sum->latency[i] += s->latency[i];
+}
+
+// Close an idle flow, its slot and socket are reused by the next client
+void flow_close(relay *r, flow *f)
+{
+    uint32_t i, j, home;
+
+    for (i = address_hash(&f->addr) & (FLOW_INDEX_SIZE - 1); &r->flows[r->index[i]] != f;
+         i = (i + 1) & (FLOW_INDEX_SIZE - 1));
+    for (j = i;;)
+    {
+        j = (j + 1) & (FLOW_INDEX_SIZE - 1);
+        if (r->index[j] < 0)
+            break;
+        // Move j into the hole unless its probe starts after the hole
+        home = address_hash(&r->flows[r->index[j]].addr) & (FLOW_INDEX_SIZE - 1);
+        if (((j - home) & (FLOW_INDEX_SIZE - 1)) >= ((j - i) & (FLOW_INDEX_SIZE - 1)))
+        {
+            r->index[i] = r->index[j];
+            i = j;
+        }
+    }
+    r->index[i] = -1;
+
+    // Closing the socket takes it out of epoll as well
+    if (TEMP_FAILURE_RETRY(close(f->fd)) < 0)
+        ERR("close");
+    f->fd = -1;
+    add_stats(&r->closed, &f->stats);
+    r->closed_count++;
+    r->free_flows[r->free_count++] = f - r->flows;
+}
+
+// Close the flows without datagrams for flow_idle ms and none held back
+void expire_flows(relay *r)
+{
+    timer *t, *next;
+    flow *f;
+    long idle;
+
+    for (t = wheel_advance(&r->flow_wheel, r->tick); t; t = next)
+    {
+        next = t->next;
+        f = container_of(t, flow, idle);
+        idle = (r->tick - f->active) * WHEEL_TICK_NS / 1000000L;
+        if (idle < r->flow_idle)
+            timer_add(&r->flow_wheel, &f->idle, r->flow_idle - idle);
+        else if (f->held)
+            timer_add(&r->flow_wheel, &f->idle, r->flow_idle);
+        else
+            flow_close(r, f);
+    }
+}
+
+void record_latency(link_stats *stats, uint64_t us)
+{
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) <= us)
+        bucket++;
+    stats->completions++;
+    stats->latency_sum += us;
+    stats->latency[bucket]++;
+}
+
+// Upper bound (us) of the histogram bucket holding the given quantile
+uint64_t latency_quantile(link_stats *stats, double q)
+{
+    long seen = 0;
+
+    if (stats->completions == 0)
+        return 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats->latency[i];
+        if (seen >= q * stats->completions)
+            return 1ULL << i;
+    }
+    return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+// Hand a datagram to its receiver. An exchange completes when the first
+// server datagram after a client datagram reaches the client.
+void deliver(relay *r, flow *f, int direction, char *data, int len)
+{
+    uint64_t now;
+
+    if (direction == UPSTREAM)
+    {
+        if (send(f->fd, data, len, 0) < 0 && errno != ECONNREFUSED && errno != EINTR)
+            ERR("send");
+    }
+    else
+    {
+        if (r->out.count == BATCH_SIZE)
+            flush_batch(r->fd, &r->out);
+        batch_queue(&r->out, &f->addr, data, len);
+
+        if (f->pending_since)
+        {
+            now = monotonic_us();
+            record_latency(&f->stats, now - f->pending_since);
+            record_latency(&r->interval, now - f->pending_since);
+            f->pending_since = 0;
+        }
+    }
+    f->stats.bytes[direction] += len;
+    r->interval.bytes[direction] += len;
+}
+
+long sample_delay(link_config *link)
+{
+    double delay = link->delay;
+
+    if (link->exponential)
+        delay += -log(1.0 - drand48()) * link->jitter;
+    else
+        delay += (2.0 * drand48() - 1.0) * link->jitter;
+    return delay > 0 ? lround(delay) : 0;
+}
+
+#define COUNT(r, f, counter, direction) ((f)->stats.counter[direction]++, (r)->interval.counter[direction]++)
+
+// Apply the link impairments to a datagram received from one end of a flow
+void relay_datagram(relay *r, flow *f, int direction, char *data, int len)
+{
+    int copies = 1;
+    long delay;
+    packet *p;
+
+    COUNT(r, f, packets, direction);
+    f->active = r->tick;
+    if (direction == UPSTREAM && !f->pending_since)
+        f->pending_since = monotonic_us();
+
+    if (drand48() < r->link.loss)
+    {
+        COUNT(r, f, dropped, direction);
+        return;
+    }
+    if (drand48() < r->link.duplicate)
+    {
+        COUNT(r, f, duplicated, direction);
+        copies++;
+    }
+
+    while (copies--)
+    {
+        delay = sample_delay(&r->link);
+        if (drand48() < r->link.reorder)
+        {
+            COUNT(r, f, reordered, direction);
+            delay += r->link.reorder_delay;
+        }
+        if (delay == 0)
+        {
+            deliver(r, f, direction, data, len);
+            continue;
+        }
+
+        if (!r->free_packets)
+        {
+            r->overflows++;
+            COUNT(r, f, dropped, direction);
+            continue;
+        }
+        p = container_of(r->free_packets, packet, timer);
+        r->free_packets = p->timer.next;
+        p->seq = r->seq++;
+        p->flow = f;
+        f->held++;
+        p->direction = direction;
+        p->len = len;
+        memcpy(p->data, data, len);
+        timer_add(&r->wheel, &p->timer, delay);
+    }
+}
+
+// Drain a socket, datagrams from the clients socket start flows
+void receive_datagrams(relay *r, flow *f)
+{
+    int fd = f ? f->fd : r->fd, rounds = 0;
+    flow *from;
+
+    while (receive_batch(fd, &r->in) > 0)
+    {
+        for (int i = 0; i < r->in.count; i++)
+        {
+            if (r->in.msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                r->truncated++;
+                continue;
+            }
+            if (f)
+                relay_datagram(r, f, DOWNSTREAM, batch_data(&r->in, i), r->in.msgs[i].msg_len);
+            else if ((from = flow_get(r, &r->in.addr[i])))
+                relay_datagram(r, from, UPSTREAM, batch_data(&r->in, i), r->in.msgs[i].msg_len);
+            else
+                r->refused++;
+        }
+        if (r->in.count < BATCH_SIZE || ++rounds == 8)
+            break;
+    }
+}
+
+void deliver_expired(relay *r)
+{
+    timer *t, *next;
+    packet *p;
+
+    for (t = sort_expired(wheel_advance(&r->wheel, r->tick)); t; t = next)
+    {
+        next = t->next;
+        p = container_of(t, packet, timer);
+        deliver(r, p->flow, p->direction, p->data, p->len);
+        p->flow->held--;
+        p->timer.next = r->free_packets;
+        r->free_packets = &p->timer;
+    }
+}
+
+double percent(long part, long all)
+{
+    return all ? 100.0 * part / all : 0.0;
+}
+
+void print_interval(relay *r, double seconds)
+{
+    link_stats *s = &r->interval;
+
+    printf("%5.0fs loss %5.1f%% | up %ld drop %.1f%% | down %ld drop %.1f%% | goodput %.1f KB/s | "
+           "%ld exchanges/s, latency p50 %lu us p99 %lu us\n",
+           seconds, 100.0 * r->link.loss, s->packets[UPSTREAM], percent(s->dropped[UPSTREAM], s->packets[UPSTREAM]),
+           s->packets[DOWNSTREAM], percent(s->dropped[DOWNSTREAM], s->packets[DOWNSTREAM]),
+           (s->bytes[UPSTREAM] + s->bytes[DOWNSTREAM]) / 1024.0, s->completions, latency_quantile(s, 0.5),
+           latency_quantile(s, 0.99));
+}
+
+void print_stats(char *name, link_stats *s, double seconds)
+{
+    printf("%-21s %9ld %6.1f %9ld %6.1f %6ld %6ld %11.0f %9ld %9lu %9lu %9lu\n", name, s->packets[UPSTREAM],
+           percent(s->dropped[UPSTREAM], s->packets[UPSTREAM]), s->packets[DOWNSTREAM],
+           percent(s->dropped[DOWNSTREAM], s->packets[DOWNSTREAM]), s->duplicated[UPSTREAM] + s->duplicated[DOWNSTREAM],
+           s->reordered[UPSTREAM] + s->reordered[DOWNSTREAM],
+           seconds > 0 ? (s->bytes[UPSTREAM] + s->bytes[DOWNSTREAM]) / seconds : 0.0, s->completions,
+           s->completions ? s->latency_sum / s->completions : 0, latency_quantile(s, 0.5), latency_quantile(s, 0.99));
+}
+
+void print_flows(relay *r, double seconds)
+{
+    char name[32];
+    flow *f;
+
+    printf("%-21s %9s %6s %9s %6s %6s %6s %11s %9s %9s %9s %9s\n", "client", "up", "drop%", "down", "drop%", "dup",
+           "reord", "goodput B/s", "exchanges", "avg us", "p50 us", "p99 us");
+    for (int i = 0; i < r->flow_count; i++)
+    {
+        f = &r->flows[i];
+        if (f->fd < 0)
+            continue;
+        snprintf(name, sizeof(name), "%15s:%-5d", inet_ntoa(f->addr.sin_addr), ntohs(f->addr.sin_port));
+        print_stats(name, &f->stats, seconds);
+    }
+    if (r->closed_count)
+    {
+        snprintf(name, sizeof(name), "%ld idle, closed", r->closed_count);
+        print_stats(name, &r->closed, seconds);
+    }
+    if (r->overflows)
+        printf("%ld datagrams dropped, more than %d held back\n", r->overflows, MAX_PACKETS);
+    if (r->refused)
+        printf("%ld datagrams of new clients dropped, %d clients relayed already\n", r->refused, MAX_FLOWS);
+    if (r->truncated)
+        printf("%ld datagrams dropped, longer than %d bytes\n", r->truncated, MAX_DATAGRAM);
+}
+
+void do_relay(relay *r)
+{
+    struct epoll_event events[MAX_EVENTS], event;
+    uint64_t start = monotonic_us(), report = start + 1000000, now;
+    int n, timeout;
+    long ms;
+    sigset_t mask, oldmask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    if ((r->epfd = epoll_create1(0)) < 0)
+        ERR("epoll_create1");
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->fd, &event) < 0)
+        ERR("epoll_ctl");
+
+    while (do_work)
+    {
+        now = monotonic_us();
+        // report is behind now after a stall, don't let the difference wrap
+        timeout = report > now ? (report - now + 999) / 1000 : 0;
+        if ((ms = wheel_timeout(&r->wheel)) >= 0 && ms < timeout)
+            timeout = ms;
+        if ((ms = wheel_timeout(&r->flow_wheel)) >= 0 && ms < timeout)
+            timeout = ms;
+
+        if ((n = epoll_pwait(r->epfd, events, MAX_EVENTS, timeout, &oldmask)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_pwait");
+        }
+        r->tick = current_tick();
+        for (int i = 0; i < n; i++)
+            receive_datagrams(r, events[i].data.ptr);
+
+        deliver_expired(r);
+        flush_batch(r->fd, &r->out);
+        expire_flows(r);
+
+        if ((now = monotonic_us()) >= report)
+        {
+            print_interval(r, (now - start) / 1000000.0);
+            memset(&r->interval, 0, sizeof(link_stats));
+            r->link.loss = r->link.loss + r->link.loss_step > 1.0 ? 1.0 : r->link.loss + r->link.loss_step;
+            report += 1000000;
+        }
+    }
+
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    print_flows(r, (monotonic_us() - start) / 1000000.0);
+
+    for (int i = 0; i < r->flow_count; i++)
+        if (r->flows[i].fd >= 0 && TEMP_FAILURE_RETRY(close(r->flows[i].fd)) < 0)
+            ERR("close");
+    if (TEMP_FAILURE_RETRY(close(r->epfd)) < 0)
+        ERR("close");
+}
+
+relay *create_relay(int port, struct sockaddr_in server, link_config link, long flow_idle)
+{
+    relay *r;
+
+    if (NULL == (r = malloc(sizeof(relay))) || NULL == (r->packets = malloc(sizeof(packet) * MAX_PACKETS)))
+        ERR("malloc");
+
+    r->fd = bind_inet_socket(port, SOCK_DGRAM, 0, 0);
+    r->server = server;
+    r->link = link;
+    wheel_init(&r->wheel);
+    wheel_init(&r->flow_wheel);
+    r->tick = current_tick();
+    r->free_packets = NULL;
+    for (int i = 0; i < MAX_PACKETS; i++)
+    {
+        timer_init(&r->packets[i].timer);
+        r->packets[i].timer.next = r->free_packets;
+        r->free_packets = &r->packets[i].timer;
+    }
+    r->seq = 0;
+    r->overflows = 0;
+    r->flow_count = r->free_count = 0;
+    r->flow_idle = flow_idle;
+    r->refused = r->truncated = r->closed_count = 0;
+    memset(&r->closed, 0, sizeof(link_stats));
+    for (int i = 0; i < FLOW_INDEX_SIZE; i++)
+        r->index[i] = -1;
+    memset(&r->interval, 0, sizeof(link_stats));
+    batch_init(&r->in, BATCH_SIZE, MAX_DATAGRAM);
+    batch_init(&r->out, BATCH_SIZE, MAX_DATAGRAM);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    int c, lifetime = 0, port, flow_idle = DEFAULT_FLOW_IDLE;
+    link_config link = {0};
+    relay *r;
+
+    link.reorder_delay = -1;
+    while ((c = getopt(argc, argv, "l:i:d:j:eo:g:u:f:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'l':
+                link.loss = atof(optarg) / 100.0;
+                break;
+            case 'i':
+                link.loss_step = atof(optarg) / 100.0;
+                break;
+            case 'd':
+                link.delay = atol(optarg);
+                break;
+            case 'j':
+                link.jitter = atol(optarg);
+                break;
+            case 'e':
+                link.exponential = 1;
+                break;
+            case 'o':
+                link.reorder = atof(optarg) / 100.0;
+                break;
+            case 'g':
+                link.reorder_delay = atol(optarg);
+                break;
+            case 'u':
+                link.duplicate = atof(optarg) / 100.0;
+                break;
+            case 'f':
+                flow_idle = atoi(optarg);
+                break;
+            case 't':
+                lifetime = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 3 || (port = atoi(argv[optind])) <= 0 || link.loss < 0 || link.loss > 1 ||
+        link.delay < 0 || link.jitter < 0 || lifetime < 0 || flow_idle < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (link.reorder_delay < 0)
+        link.reorder_delay = link.delay + link.jitter + 1;
+
+    srand48(time(NULL));
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("Seting SIGPIPE");
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Seting SIGINT");
+    if (sethandler(sigint_handler, SIGALRM))
+        ERR("Seting SIGALRM");
+
+    r = create_relay(port, make_address(argv[optind + 1], argv[optind + 2]), link, flow_idle * 1000L);
+    if (lifetime)
+        alarm(lifetime);
+    do_relay(r);
+
+    if (TEMP_FAILURE_RETRY(close(r->fd)) < 0)
+        ERR("close");
+    batch_free(&r->in);
+    batch_free(&r->out);
+    free(r->packets);
+    free(r);
+    fprintf(stderr, "Relay has terminated.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+// Batch mode of the task protocol. A datagram starts with batch_header
+// (network byte order) followed by count tasks stored as a struct of arrays:
+// first operands, second operands, then 2-bit opcodes packed four per byte.
+// Answers carry one signed byte per task in the order of the tasks.
+// Legacy datagrams are five words starting with 0 or 1, never with the magic.
+
+#define BATCH_MAGIC 0x544b4231 // "TKB1"
+#define BATCH_VERSION 1
+#define BATCH_MAX_TASKS 512
+
+// Datagram types
+#define BATCH_READY 1 // count - tasks wanted
+#define BATCH_TASKS 2
+#define BATCH_ANSWERS 3
+
+// Opcodes
+#define BATCH_OP_ADD 0
+#define BATCH_OP_SUB 1
+#define BATCH_OP_MUL 2
+
+typedef struct batch_header
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint16_t count;
+    uint32_t id; // chosen by the server, echoed in the answers
+} batch_header;
+
+#define BATCH_OPCODES_SIZE(count) (((count) + 3) / 4)
+#define BATCH_TASKS_SIZE(count) (sizeof(batch_header) + 2 * (count) + BATCH_OPCODES_SIZE(count))
+#define BATCH_ANSWERS_SIZE(count) (sizeof(batch_header) + (count))
+#define BATCH_DATAGRAM_MAX BATCH_TASKS_SIZE(BATCH_MAX_TASKS)
+
+static inline uint8_t *batch_operand1(batch_header *h)
+{
+    return (uint8_t *) (h + 1);
+}
+
+static inline uint8_t *batch_operand2(batch_header *h, int count)
+{
+    return (uint8_t *) (h + 1) + count;
+}
+
+static inline uint8_t *batch_opcodes(batch_header *h, int count)
+{
+    return (uint8_t *) (h + 1) + 2 * count;
+}
+
+static inline int8_t *batch_results(batch_header *h)
+{
+    return (int8_t *) (h + 1);
+}
+
+static inline void batch_header_init(batch_header *h, int type, int count, uint32_t id)
+{
+    h->magic = htonl(BATCH_MAGIC);
+    h->version = BATCH_VERSION;
+    h->type = type;
+    h->count = htons(count);
+    h->id = htonl(id);
+}
+
+// Header of a well-formed batch datagram of len bytes or NULL
+static inline batch_header *batch_check(void *buf, ssize_t len)
+{
+    batch_header *h = buf;
+    int count;
+
+    if (len < (ssize_t) sizeof(batch_header) || ntohl(h->magic) != BATCH_MAGIC || h->version != BATCH_VERSION)
+        return NULL;
+    count = ntohs(h->count);
+    if (count > BATCH_MAX_TASKS)
+        return NULL;
+    switch (h->type)
+    {
+        case BATCH_READY:
+            return len == sizeof(batch_header) ? h : NULL;
+        case BATCH_TASKS:
+            return len == BATCH_TASKS_SIZE(count) ? h : NULL;
+        case BATCH_ANSWERS:
+            return len == BATCH_ANSWERS_SIZE(count) ? h : NULL;
+    }
+    return NULL;
+}
+
+#endif
@@ -12,6 +12,10 @@
 #include <netdb.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include <poll.h>
+#include <time.h>
+#include "batch.h"
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -28,6 +32,8 @@
 #define LIFETIME 7
 #define SLEEPMIN 500
 #define SLEEPMAX 2500
+#define MAX_PIPELINE 1024
+#define READY_TIMEOUT 3000 // ms without a task before the ready request is repeated
 volatile sig_atomic_t quit = 0;
 
 void sigint_handler(int sig)
@@ -52,69 +58,10 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s domain port\n", name);
-}
-
-ssize_t bulk_read(int fd, char *buf, size_t count)
-{
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0 && errno == EAGAIN)
-            continue;
-        if (c < 0)
-            return c;
-        if (0 == c)
-            return len;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
-}
-
-ssize_t bulk_write(int fd, char *buf, size_t count)
-{
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
-}
-
-int make_socket(void)
-{
-    int sock;
-    sock = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
-}
-
-struct sockaddr_in make_address(char *address, char *port)
-{
-    int ret;
-    struct sockaddr_in addr;
-    struct addrinfo *result;
-    struct addrinfo hints = {};
-    hints.ai_family = AF_INET;
-    if ((ret = getaddrinfo(address, port, &hints, &result)))
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-        exit(EXIT_FAILURE);
-    }
-    addr = *(struct sockaddr_in *)(result->ai_addr);
-    freeaddrinfo(result);
-    return addr;
+    fprintf(stderr, "USAGE: %s [-w pipeline] [-t seconds] [-b tasks] domain port\n", name);
+    fprintf(stderr, "-w - worker mode, solve tasks on pipeline sockets until SIGINT\n");
+    fprintf(stderr, "-t - worker lifetime\n");
+    fprintf(stderr, "-b - worker asks for batches of up to %d tasks per datagram\n", BATCH_MAX_TASKS);
 }
 
 void prepare_ready_request(int32_t data[5])
@@ -180,6 +127,30 @@ void solve_task(int32_t data[5])
     data[4] = htonl(result);
 }
 
+// Solve count tasks of a batch into one result byte each. Every operation
+// is computed and the opcode selects one through a mask, so there are no
+// branches in the loop and the compiler can vectorize it.
+void solve_batch(const uint8_t *operand1, const uint8_t *operand2, const uint8_t *opcodes, int8_t *results,
+                 int count)
+{
+    uint8_t ops[BATCH_MAX_TASKS + 3];
+
+    for (int i = 0; i < BATCH_OPCODES_SIZE(count); i++)
+    {
+        ops[4 * i] = opcodes[i] & 3;
+        ops[4 * i + 1] = (opcodes[i] >> 2) & 3;
+        ops[4 * i + 2] = (opcodes[i] >> 4) & 3;
+        ops[4 * i + 3] = opcodes[i] >> 6;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t a = operand1[i], b = operand2[i], op = ops[i];
+        uint8_t add = -(op == BATCH_OP_ADD), sub = -(op == BATCH_OP_SUB), mul = -(op == BATCH_OP_MUL);
+        results[i] = (int8_t) ((add & (uint8_t) (a + b)) | (sub & (uint8_t) (a - b)) | (mul & (uint8_t) (a * b)));
+    }
+}
+
 int client_sleep()
 {
     int sleep_time = rand() % (SLEEPMAX - SLEEPMIN + 1) + SLEEPMIN;
@@ -227,13 +198,187 @@ void do_client(int fd, struct sockaddr_in addr, socklen_t size)
     printf("Sent retransmission task answer.\n");
 }
 
+typedef struct worker_stats
+{
+    long tasks; // answers sent
+    long ready_retries; // ready requests repeated after READY_TIMEOUT
+} worker_stats;
+
+long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+// Ask for one task, or for a batch of batch tasks when batch > 0
+int send_ready_request(int fd, int batch)
+{
+    int32_t data[5];
+    batch_header h;
+    ssize_t ret;
+
+    if (batch)
+    {
+        batch_header_init(&h, BATCH_READY, batch, 0);
+        ret = send(fd, &h, sizeof(h), 0);
+    }
+    else
+    {
+        prepare_ready_request(data);
+        ret = send(fd, data, sizeof(int32_t[5]), 0);
+    }
+    if (ret < 0)
+    {
+        if (errno == EINTR || errno == ECONNREFUSED)
+            return 0;
+        ERR("send");
+    }
+    return 1;
+}
+
+void print_worker_stats(worker_stats *stats, long elapsed)
+{
+    printf("Tasks solved: %ld (%.1f/s), ready retries: %ld\n", stats->tasks,
+           elapsed > 0 ? stats->tasks * 1000.0 / elapsed : 0.0, stats->ready_retries);
+}
+
+// Answer a batch of tasks, returns how many were solved
+int answer_batch(int fd, batch_header *h)
+{
+    int count = ntohs(h->count);
+    int32_t answers[(BATCH_ANSWERS_SIZE(BATCH_MAX_TASKS) + 3) / 4];
+    batch_header *a = (batch_header *) answers;
+
+    *a = *h;
+    a->type = BATCH_ANSWERS;
+    solve_batch(batch_operand1(h), batch_operand2(h, count), batch_opcodes(h, count), batch_results(a), count);
+    if (send(fd, a, BATCH_ANSWERS_SIZE(count), 0) < 0 && errno != ECONNREFUSED && errno != EINTR)
+        ERR("send");
+    return count;
+}
+
+void clear_socket_error(int fd)
+{
+    int error;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        ERR("getsockopt");
+}
+
+// Answer a task or a batch waiting on fd, returns 0 if there was none
+int receive_task(int fd, int32_t *data, size_t size, int batch, worker_stats *stats)
+{
+    ssize_t len;
+    batch_header *h;
+
+    if ((len = recv(fd, data, size, MSG_DONTWAIT)) < 0)
+        return 0;
+    if (batch && (h = batch_check(data, len)) && h->type == BATCH_TASKS)
+        stats->tasks += answer_batch(fd, h);
+    else if (!batch && len == sizeof(int32_t[5]))
+    {
+        solve_task(data);
+        if (send(fd, data, sizeof(int32_t[5]), 0) < 0 && errno != ECONNREFUSED && errno != EINTR)
+            ERR("send");
+        stats->tasks++;
+    }
+    else
+        return 0;
+    send_ready_request(fd, batch);
+    return 1;
+}
+
+// Solve tasks until quit on pipeline connected sockets. Every answer is
+// followed by the next ready request, so a socket always has one task
+// (or one batch of tasks) in flight.
+void do_worker(struct sockaddr_in addr, int pipeline, int batch)
+{
+    struct pollfd fds[MAX_PIPELINE];
+    long last_activity[MAX_PIPELINE];
+    int32_t data[(BATCH_DATAGRAM_MAX + 3) / 4];
+    worker_stats stats = {0};
+    long start = monotonic_ms(), report = start + 1000, now;
+
+    for (int i = 0; i < pipeline; i++)
+    {
+        fds[i].fd = make_socket(PF_INET, SOCK_DGRAM);
+        fds[i].events = POLLIN;
+        if (connect(fds[i].fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            ERR("connect");
+        send_ready_request(fds[i].fd, batch);
+        last_activity[i] = start;
+    }
+
+    while (!quit)
+    {
+        if (poll(fds, pipeline, 100) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("poll");
+        }
+        now = monotonic_ms();
+
+        for (int i = 0; i < pipeline; i++)
+        {
+            // ICMP port unreachable (no server yet) stays pending and keeps
+            // poll returning until it is read
+            if (fds[i].revents & (POLLERR | POLLHUP))
+                clear_socket_error(fds[i].fd);
+            if ((fds[i].revents & POLLIN) && receive_task(fds[i].fd, data, sizeof(data), batch, &stats))
+                last_activity[i] = now; // only an answered task counts
+            else if (now - last_activity[i] >= READY_TIMEOUT)
+            {
+                // Ready request or its task was lost
+                send_ready_request(fds[i].fd, batch);
+                stats.ready_retries++;
+                last_activity[i] = now;
+            }
+        }
+
+        if (now >= report)
+        {
+            print_worker_stats(&stats, now - start);
+            report += 1000;
+        }
+    }
+
+    print_worker_stats(&stats, monotonic_ms() - start);
+    for (int i = 0; i < pipeline; i++)
+        if (TEMP_FAILURE_RETRY(close(fds[i].fd)) < 0)
+            ERR("close");
+}
+
 int main(int argc, char **argv)
 {
-    int fd;
+    int fd, c;
+    int pipeline = 0, lifetime = 0, batch = 0;
     struct sockaddr_in addr;
     socklen_t size = sizeof(addr);
     
-    if (argc != 3)
+    while ((c = getopt(argc, argv, "w:t:b:")) != -1)
+    {
+        switch (c)
+        {
+            case 'w':
+                pipeline = atoi(optarg);
+                break;
+            case 't':
+                lifetime = atoi(optarg);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || pipeline < 0 || pipeline > MAX_PIPELINE || lifetime < 0 || batch < 0 ||
+        batch > BATCH_MAX_TASKS)
     {
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -247,8 +392,19 @@ int main(int argc, char **argv)
     if (sethandler(sigalarm_handler, SIGALRM))
         ERR("Settin SIGALRM");
     
-    fd = make_socket();
-    addr = make_address(argv[1], argv[2]);
+    addr = make_address(argv[optind], argv[optind + 1]);
+    if (batch && !pipeline)
+        pipeline = 1;
+    if (pipeline)
+    {
+        if (lifetime)
+            alarm(lifetime);
+        do_worker(addr, pipeline, batch);
+        fprintf(stderr, "Worker has terminated.\n");
+        return EXIT_SUCCESS;
+    }
+
+    fd = make_socket(PF_INET, SOCK_DGRAM);
     do_client(fd, addr, size);
 
     if (TEMP_FAILURE_RETRY(close(fd)) < 0)
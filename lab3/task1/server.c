@@ -13,6 +13,14 @@
 #include <signal.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include "binlog.h"
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "batch.h"
+#include "wheel.h"
+#include "dgram.h"
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -26,9 +34,86 @@
    _rc; })
 #endif
 
-#define BACKLOG 3
 #define PORT 2000
+#define MAX_SESSIONS 8192
+#define SESSION_INDEX_SIZE (2 * MAX_SESSIONS) // power of two
+#define DEFAULT_RETRIES 1 // retransmissions of an unanswered task
+
+// Retransmission timeout (RFC 6298 estimator), in microseconds
+#define RTO_INITIAL 2000000 // peers without RTT samples wait 2 s
+#define RTO_MIN 5000
+#define RTO_MAX 8000000
+#define RTT_CACHE_SIZE 16384 // power of two
+#define BATCH_SIZE 64 // datagrams per recvmmsg/sendmmsg
+#define MAX_RECV_ROUNDS 8 // recvmmsg calls per wakeup
+#define MAX_THREADS 64
+
+#define INDEX_EMPTY -1
+#define INDEX_DELETED -2
+
+// Datagrams queued for the clients and the tasks each of them carries
+typedef struct task_batch
+{
+    datagram_batch batch;
+    int tasks[BATCH_SIZE];
+} task_batch;
+
+typedef struct session
+{
+    struct sockaddr_in addr;
+    int used;
+    int retries; // retransmissions sent
+    long rto; // current timeout, us
+    uint64_t sent_us; // first copy of the task sent
+    int32_t data[5]; // data[0] - nonce echoed in the answer
+    int8_t answer; // expected answer to data
+    batch_header *packet; // batch of tasks, NULL for a single task
+    timer timer; // answer deadline
+    struct session *prev, *next; // active sessions, free list
+} session;
+
+typedef struct answer_stats
+{
+    long correct, incorrect;
+    long late; // no task waiting for the answer: timed out, answered already or spoofed
+} answer_stats;
+
+// Smoothed RTT of a client, kept between its tasks
+typedef struct peer_rtt
+{
+    struct sockaddr_in addr;
+    long srtt, rttvar; // us, srtt = 0 - no samples yet
+} peer_rtt;
+
+typedef struct session_table
+{
+    session sessions[MAX_SESSIONS];
+    int32_t index[SESSION_INDEX_SIZE]; // open addressing, positions in sessions
+    int count;
+    int deleted; // tombstones in index
+    session *active;
+    session *free;
+    peer_rtt rtt[RTT_CACHE_SIZE]; // direct-mapped cache
+    void *packets; // free batch buffers, linked through their first bytes
+    answer_stats answers;
+} session_table;
+
 volatile sig_atomic_t do_work = 1;
+int max_retries = DEFAULT_RETRIES;
+__thread unsigned int rand_seed; // rand() takes a lock shared by all threads
+
+#define ADD(a, b) ((a) + (b))
+#define SUB(a, b) ((a) - (b))
+#define MUL(a, b) ((a) * (b))
+#define RESULT_ROW(op, a) {op(a, 0), op(a, 1), op(a, 2), op(a, 3), op(a, 4), \
+                           op(a, 5), op(a, 6), op(a, 7), op(a, 8), op(a, 9)}
+#define RESULT_TABLE(op) {RESULT_ROW(op, 0), RESULT_ROW(op, 1), RESULT_ROW(op, 2), RESULT_ROW(op, 3), \
+                          RESULT_ROW(op, 4), RESULT_ROW(op, 5), RESULT_ROW(op, 6), RESULT_ROW(op, 7), \
+                          RESULT_ROW(op, 8), RESULT_ROW(op, 9)}
+
+// Results of every task, indexed by opcode and operands
+static const int8_t answer_table[3][10][10] = {RESULT_TABLE(ADD), RESULT_TABLE(SUB), RESULT_TABLE(MUL)};
+static const char operators[3] = {'+', '-', '*'}; // by opcode
 
 void sigint_handler(int sig)
 {
@@ -47,133 +132,438 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s\n", name);
+    fprintf(stderr, "USAGE: %s [-r retries] [-t threads]\n", name);
+    fprintf(stderr, "retries - retransmissions of an unanswered task (default %d)\n", DEFAULT_RETRIES);
+    fprintf(stderr, "threads - server threads, each with its own SO_REUSEPORT socket (max %d)\n", MAX_THREADS);
+}
+
+int is_ready_request(int32_t data[5])
+{
+    return ntohl(data[0]) == 1;
+}
+
+// Returns the expected answer
+int prepare_task(int32_t data[5])
+{
+    // 0 - ready request, nonce in tasks (even, so never a ready request)
+    // 1 - operand1
+    // 2 - operand2
+    // 3 - operation
+    // 4 - result
+
+    int op1 = rand_r(&rand_seed) % 10, op2 = rand_r(&rand_seed) % 10;
+    int op = rand_r(&rand_seed) % 2 ? (rand_r(&rand_seed) % 2 ? BATCH_OP_ADD : BATCH_OP_SUB) : BATCH_OP_MUL;
+
+    data[0] = htonl((uint32_t) rand_r(&rand_seed) << 1);
+    data[1] = htonl(op1);
+    data[2] = htonl(op2);
+    data[3] = htonl((int32_t) operators[op]);
+    data[4] = htonl(0);
+    return answer_table[op][op1][op2];
 }
 
-ssize_t bulk_read(int fd, char *buf, size_t count)
+// Fill count tasks with the same operator odds as prepare_task
+void prepare_batch(batch_header *h, int count, uint32_t id)
 {
-    int c;
-    size_t len = 0;
-    do
+    uint8_t *operand1 = batch_operand1(h), *operand2 = batch_operand2(h, count), *opcodes = batch_opcodes(h, count);
+
+    batch_header_init(h, BATCH_TASKS, count, id);
+    memset(opcodes, 0, BATCH_OPCODES_SIZE(count));
+    for (int i = 0; i < count; i++)
     {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0 && errno == EAGAIN)
-            continue;
-        if (c < 0)
-            return c;
-        if (0 == c)
-            return len;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+        operand1[i] = rand_r(&rand_seed) % 10;
+        operand2[i] = rand_r(&rand_seed) % 10;
+        opcodes[i >> 2] |= (rand_r(&rand_seed) % 2 ? (rand_r(&rand_seed) % 2 ? BATCH_OP_ADD : BATCH_OP_SUB) : BATCH_OP_MUL) << ((i & 3) * 2);
+    }
+}
+
+// Number of wrong answers to the tasks of h
+int batch_mistakes(batch_header *h, int8_t *results)
+{
+    int count = ntohs(h->count), mistakes = 0;
+    uint8_t *operand1 = batch_operand1(h), *operand2 = batch_operand2(h, count), *opcodes = batch_opcodes(h, count);
+
+    for (int i = 0; i < count; i++)
+        mistakes += results[i] != answer_table[(opcodes[i >> 2] >> ((i & 3) * 2)) & 3][operand1[i]][operand2[i]];
+    return mistakes;
+}
+
+// Send all queued datagrams, returns how many tasks they carried
+int flush_tasks(int fd, task_batch *out)
+{
+    int count = out->batch.count, tasks = 0;
+
+    flush_batch(fd, &out->batch);
+    for (int i = 0; i < count; i++)
+        if (out->batch.msgs[i].msg_len)
+            tasks += out->tasks[i];
+    return tasks;
+}
+
+// Queue a datagram carrying tasks for the next flush
+void queue_task(int fd, task_batch *out, struct sockaddr_in *addr, void *data, size_t len, int tasks,
+                int *tasks_count)
+{
+    if (out->batch.count == BATCH_SIZE)
+        *tasks_count += flush_tasks(fd, out);
+
+    out->tasks[out->batch.count] = tasks;
+    batch_queue(&out->batch, addr, data, len);
 }
 
-ssize_t bulk_write(int fd, char *buf, size_t count)
+void print_answer(int32_t data[5])
 {
-    int c;
-    size_t len = 0;
-    do
+    LOG(LOG_DEBUG, "%d %c %d = %d\n", ntohl(data[1]), ntohl(data[3]), ntohl(data[2]), ntohl(data[4]));
+}
+
+session_table *create_session_table()
+{
+    session_table *table;
+
+    if (NULL == (table = malloc(sizeof(session_table))))
+        ERR("malloc");
+
+    table->count = table->deleted = 0;
+    table->active = NULL;
+    table->free = NULL;
+    for (int i = MAX_SESSIONS - 1; i >= 0; i--)
     {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+        table->sessions[i].used = 0;
+        table->sessions[i].next = table->free;
+        table->free = &table->sessions[i];
+    }
+    for (int i = 0; i < SESSION_INDEX_SIZE; i++)
+        table->index[i] = INDEX_EMPTY;
+    memset(table->rtt, 0, sizeof(table->rtt));
+    table->packets = NULL;
+    memset(&table->answers, 0, sizeof(answer_stats));
+
+    return table;
 }
 
-int make_socket(int domain, int type)
+void free_session_table(session_table *table)
 {
-    int sock;
-    sock = socket(domain, type, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
+    void *next;
+
+    for (session *s = table->active; s; s = s->next)
+        free(s->packet);
+    for (void *p = table->packets; p; p = next)
+    {
+        next = *(void **) p;
+        free(p);
+    }
+    free(table);
 }
 
-int bind_inet_socket(uint16_t port, int type)
+// Batch buffers are kept for reuse instead of being freed
+batch_header *packet_alloc(session_table *table)
 {
-    struct sockaddr_in addr;
-    int socketfd, t = 1;
-    socketfd = make_socket(PF_INET, type);
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
-        ERR("setsockopt");
-    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        ERR("bind");
-    if (SOCK_STREAM == type)
-        if (listen(socketfd, BACKLOG) < 0)
-            ERR("listen");
-    return socketfd;
+    void *p;
+
+    if ((p = table->packets))
+        table->packets = *(void **) p;
+    else if (NULL == (p = malloc(BATCH_DATAGRAM_MAX)))
+        ERR("malloc");
+    return p;
 }
 
-int is_ready_request(int32_t data[5])
+void packet_free(session_table *table, batch_header *h)
 {
-    return ntohl(data[0]);
+    *(void **) h = table->packets;
+    table->packets = h;
 }
 
-void prepare_task(int32_t data[5])
+// Position in index of the session with given address, or of the empty slot ending the probe
+uint32_t session_probe(session_table *table, struct sockaddr_in *addr)
 {
-    // 0 - ready request
-    // 1 - operand1
-    // 2 - operand2
-    // 3 - operation
-    // 4 - result
+    uint32_t i = address_hash(addr) & (SESSION_INDEX_SIZE - 1);
 
-    data[0] = htonl(0);
-    data[1] = htonl(rand() % 10);
-    data[2] = htonl(rand() % 10);
-    data[3] = htonl((int32_t)((rand() % 2 ? (rand() % 2 ? '+' : '-') : '*')));
-    data[4] = htonl(0);
+    while (table->index[i] != INDEX_EMPTY)
+    {
+        if (table->index[i] >= 0 && same_address(&table->sessions[table->index[i]].addr, addr))
+            break;
+        i = (i + 1) & (SESSION_INDEX_SIZE - 1);
+    }
+    return i;
+}
+
+session *session_find(session_table *table, struct sockaddr_in *addr)
+{
+    int32_t position = table->index[session_probe(table, addr)];
+    return position >= 0 ? &table->sessions[position] : NULL;
+}
+
+// Rebuild the index without tombstones
+void session_reindex(session_table *table)
+{
+    for (int i = 0; i < SESSION_INDEX_SIZE; i++)
+        table->index[i] = INDEX_EMPTY;
+    for (session *s = table->active; s; s = s->next)
+        table->index[session_probe(table, &s->addr)] = s - table->sessions;
+    table->deleted = 0;
 }
 
-int send_task(int fd, struct sockaddr_in addr, socklen_t size, int32_t data[5])
+// New session for a client, NULL if the table is full
+session *session_add(session_table *table, struct sockaddr_in *addr)
 {
-    if (sendto(fd, data, sizeof(int32_t[5]), 0, (struct sockaddr *) &addr, size) < 0)
+    session *s;
+    uint32_t i;
+
+    if (NULL == (s = table->free))
+        return NULL;
+    if (table->count + table->deleted >= SESSION_INDEX_SIZE * 3 / 4)
+        session_reindex(table);
+
+    table->free = s->next;
+    memset(s, 0, sizeof(session));
+    timer_init(&s->timer);
+    s->addr = *addr;
+    s->used = 1;
+
+    // Reuse a tombstone met before the end of the probe
+    for (i = address_hash(addr) & (SESSION_INDEX_SIZE - 1); table->index[i] >= 0; i = (i + 1) & (SESSION_INDEX_SIZE - 1));
+    if (table->index[i] == INDEX_DELETED)
+        table->deleted--;
+    table->index[i] = s - table->sessions;
+
+    s->next = table->active;
+    if (table->active)
+        table->active->prev = s;
+    table->active = s;
+    table->count++;
+    return s;
+}
+
+void session_remove(session_table *table, session *s)
+{
+    table->index[session_probe(table, &s->addr)] = INDEX_DELETED;
+    table->deleted++;
+
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        table->active = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    if (s->packet)
+        packet_free(table, s->packet);
+
+    s->used = 0;
+    s->next = table->free;
+    table->free = s;
+    table->count--;
+}
+
+uint64_t monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+// RTT estimate of a client, a colliding client takes the slot over
+peer_rtt *rtt_lookup(session_table *table, struct sockaddr_in *addr)
+{
+    peer_rtt *peer = &table->rtt[address_hash(addr) & (RTT_CACHE_SIZE - 1)];
+
+    if (!same_address(&peer->addr, addr))
     {
-        if (ECONNRESET == errno)
+        peer->addr = *addr;
+        peer->srtt = peer->rttvar = 0;
+    }
+    return peer;
+}
+
+long rto_us(peer_rtt *peer)
+{
+    long rto;
+
+    if (peer->srtt == 0)
+        return RTO_INITIAL;
+
+    rto = peer->srtt + (4 * peer->rttvar > WHEEL_TICK_NS / 1000 ? 4 * peer->rttvar : WHEEL_TICK_NS / 1000);
+    return rto < RTO_MIN ? RTO_MIN : rto > RTO_MAX ? RTO_MAX : rto;
+}
+
+void rtt_sample(peer_rtt *peer, long rtt)
+{
+    if (rtt <= 0)
+        rtt = 1;
+
+    if (peer->srtt == 0)
+    {
+        peer->srtt = rtt;
+        peer->rttvar = rtt / 2;
+        return;
+    }
+
+    peer->rttvar = (3 * peer->rttvar + labs(peer->srtt - rtt)) / 4;
+    peer->srtt = (7 * peer->srtt + rtt) / 8;
+}
+
+void arm_session_timer(timer_wheel *wheel, session *s)
+{
+    timer_add(wheel, &s->timer, (s->rto + 999) / 1000);
+}
+
+// Retransmit a task that was not answered in time with the timeout doubled,
+// drop a client that used up its retries
+void session_timeout(int fd, session_table *table, timer_wheel *wheel, task_batch *out, session *s, int *tasks_count)
+{
+    if (s->retries < max_retries)
+    {
+        if (s->packet)
+            queue_task(fd, out, &s->addr, s->packet, BATCH_TASKS_SIZE(ntohs(s->packet->count)),
+                       ntohs(s->packet->count), tasks_count);
+        else
+            queue_task(fd, out, &s->addr, s->data, sizeof(int32_t[5]), 1, tasks_count);
+        s->retries++;
+        s->rto = s->rto * 2 > RTO_MAX ? RTO_MAX : s->rto * 2;
+        arm_session_timer(wheel, s);
+        LOG(LOG_DEBUG, "Sent retransmission task.\n");
+    }
+    else
+    {
+        session_remove(table, s);
+        LOG(LOG_INFO, "Client disconnected.\n");
+    }
+}
+
+// Handle a five-word datagram received from addr
+void handle_task(int fd, session_table *table, timer_wheel *wheel, task_batch *out,
+                 struct sockaddr_in *addr, int32_t data[5], int *tasks_count)
+{
+    session *s = session_find(table, addr);
+
+    if (is_ready_request(data))
+    {
+        LOG(LOG_DEBUG, "Received ready request.\n");
+        if (s)
         {
-            fprintf(stderr, "Connection reset by peer.\n");
-            return 0;
+            LOG(LOG_WARN, "Client already has a task.\n");
+            return;
         }
-        else
-            ERR("send");
+        if (NULL == (s = session_add(table, addr)))
+        {
+            LOG(LOG_WARN, "Too many clients.\n");
+            return;
+        }
+
+        s->answer = prepare_task(s->data);
+        queue_task(fd, out, &s->addr, s->data, sizeof(int32_t[5]), 1, tasks_count);
+        s->sent_us = monotonic_us();
+        s->rto = rto_us(rtt_lookup(table, addr));
+        arm_session_timer(wheel, s);
+        LOG(LOG_DEBUG, "Sent task.\n");
+        return;
+    }
+
+    // Answers must come from the client holding the task and carry its nonce
+    if (!s || s->packet || data[0] != s->data[0])
+    {
+        table->answers.late++;
+        return;
     }
 
-    return 1;
+    // Answer received, an answer to a retransmitted task is ambiguous (Karn's rule)
+    print_answer(data);
+    table->answers.correct += (int32_t) ntohl(data[4]) == s->answer;
+    table->answers.incorrect += (int32_t) ntohl(data[4]) != s->answer;
+    if (s->retries == 0)
+        rtt_sample(rtt_lookup(table, addr), monotonic_us() - s->sent_us);
+    timer_del(wheel, &s->timer);
+    session_remove(table, s);
 }
 
-void print_answer(int32_t data[5])
+// Handle a batch datagram received from addr
+void handle_batch(int fd, session_table *table, timer_wheel *wheel, task_batch *out,
+                  struct sockaddr_in *addr, batch_header *h, int *tasks_count)
 {
-    printf("%d %c %d = %d\n", ntohl(data[1]), ntohl(data[3]), ntohl(data[2]), ntohl(data[4]));
+    session *s = session_find(table, addr);
+    int count = ntohs(h->count), mistakes;
+
+    if (h->type == BATCH_READY)
+    {
+        if (s)
+        {
+            LOG(LOG_WARN, "Client already has a task.\n");
+            return;
+        }
+        if (count < 1)
+            count = 1;
+        if (NULL == (s = session_add(table, addr)))
+        {
+            LOG(LOG_WARN, "Too many clients.\n");
+            return;
+        }
+
+        s->packet = packet_alloc(table);
+        prepare_batch(s->packet, count, rand_r(&rand_seed));
+        queue_task(fd, out, &s->addr, s->packet, BATCH_TASKS_SIZE(count), count, tasks_count);
+        s->sent_us = monotonic_us();
+        s->rto = rto_us(rtt_lookup(table, addr));
+        arm_session_timer(wheel, s);
+        LOG(LOG_DEBUG, "Sent batch of %d tasks.\n", count);
+        return;
+    }
+
+    if (h->type != BATCH_ANSWERS)
+        return;
+    // Answers must match the batch the client holds, the batch id is its nonce
+    if (!s || !s->packet || h->id != s->packet->id || h->count != s->packet->count)
+    {
+        table->answers.late += count;
+        return;
+    }
+
+    mistakes = batch_mistakes(s->packet, batch_results(h));
+    table->answers.correct += count - mistakes;
+    table->answers.incorrect += mistakes;
+    LOG(LOG_DEBUG, "Received %d answers to batch %u, %d wrong.\n", count, ntohl(h->id), mistakes);
+    if (s->retries == 0)
+        rtt_sample(rtt_lookup(table, addr), monotonic_us() - s->sent_us);
+    timer_del(wheel, &s->timer);
+    session_remove(table, s);
 }
 
-void do_server(int fd)
+void handle_datagram(int fd, session_table *table, timer_wheel *wheel, task_batch *out,
+                     struct sockaddr_in *addr, void *buf, ssize_t len, int *tasks_count)
+{
+    batch_header *h;
+
+    // A batch of answers can be five words long too, the magic tells them apart
+    if ((h = batch_check(buf, len)))
+        handle_batch(fd, table, wheel, out, addr, h, tasks_count);
+    else if (len == sizeof(int32_t[5]))
+        handle_task(fd, table, wheel, out, addr, buf, tasks_count);
+}
+
+// Serve clients on fd until SIGINT, returns the number of tasks sent.
+// SIGUSR1 only wakes the loop, it is used to stop server threads.
+int do_server(int fd, answer_stats *answers)
 {
-    int client_connected = 0;
-    int task_sent = 0;
     int tasks_count = 0;
-    int fd_res;
-    int retransmission_request  = 0;
-    int retransmission_sent = 0;
-    int32_t data[5];
+    int fd_res, rounds;
     fd_set base_rfds, rfds;
-    struct sockaddr_in addr, connected_addr;
-    socklen_t size = sizeof(addr);
-    struct timespec* timeout = NULL;
-    struct timespec time;
+    long ms;
+    struct timespec timeout;
+    session_table *table = create_session_table();
+    timer_wheel wheel;
+    timer *expired, *next;
+    datagram_batch in;
+    task_batch *out;
+
+    wheel_init(&wheel);
+    if (NULL == (out = malloc(sizeof(task_batch))))
+        ERR("malloc");
+    batch_init(&in, BATCH_SIZE, BATCH_DATAGRAM_MAX);
+    batch_init(&out->batch, BATCH_SIZE, BATCH_DATAGRAM_MAX);
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
-    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
     
     FD_ZERO(&base_rfds);
     FD_SET(fd, &base_rfds);
@@ -181,119 +571,161 @@ void do_server(int fd)
     while (do_work)
     {
         rfds = base_rfds;
-
-        timeout = NULL;
-        if (client_connected && task_sent) 
+        if ((ms = wheel_timeout(&wheel)) >= 0)
         {
-            time.tv_sec = 2;
-            timeout = &time;
-            retransmission_request = 1;
+            timeout.tv_sec = ms / 1000;
+            timeout.tv_nsec = ms % 1000 * 1000000L;
         }
 
-        if ((fd_res = pselect(fd + 1, &rfds, NULL, NULL, timeout, &oldmask)) > 0)
+        if ((fd_res = pselect(fd + 1, &rfds, NULL, NULL, ms >= 0 ? &timeout : NULL, &oldmask)) > 0)
         {
-            if (recvfrom(fd, data, sizeof(int32_t[5]), 0, (struct sockaddr *) &addr, &size) < 0)
-            {
-                if (errno == EINTR)
-                    continue;
-                ERR("recvfrom");
-            }
-            
-            // Check if we already handle any client
-            if (is_ready_request(data))
-            {
-                printf("Received ready request.\n");
-                if (client_connected)
-                {
-                    printf("Already connected with other client.\n");
-                    continue;
-                }
-                else 
-                {
-                    client_connected = 1;
-                    connected_addr = addr;
-                    task_sent = 0;
-                }
-            }
-
-            if (!task_sent)
+            // Drain the socket a batch at a time
+            rounds = 0;
+            while (receive_batch(fd, &in) > 0)
             {
-                prepare_task(data);
+                for (int i = 0; i < in.count; i++)
+                    handle_datagram(fd, table, &wheel, out, &in.addr[i], batch_data(&in, i), in.msgs[i].msg_len,
+                                    &tasks_count);
 
-                if (send_task(fd, connected_addr, size, data))
-                {
-                    tasks_count++;
-                    task_sent = 1;
-                }
-
-                printf("Sent task.\n");
-                continue;
+                if (in.count < BATCH_SIZE || ++rounds == MAX_RECV_ROUNDS)
+                    break;
             }
-            
-            // Answer received
-            print_answer(data);
-            
-            client_connected = 0;
-            retransmission_request = 0;
-            retransmission_sent = 0;
         }
-        else
-        {
-            if (fd_res == 0)
-            {
-                if (retransmission_request & !retransmission_sent)
-                {
-                    if (send_task(fd, connected_addr, size, data))
-                    {
-                        tasks_count++;
-                        task_sent = 1;
-                    }
-                    retransmission_sent = 1;
-                    printf("Sent retransmission task.\n");
-                }
-                else
-                {
-                    client_connected = 0;
-                    retransmission_request = 0;
-                    retransmission_sent = 0;
-                    printf("Client disconnected.\n");
-                }
-
-                continue;
-            }
-
-            if (errno == EINTR)
-                continue;
+        else if (fd_res < 0 && errno != EINTR)
             ERR("pselect");
+
+        for (expired = wheel_advance(&wheel, current_tick()); expired; expired = next)
+        {
+            next = expired->next;
+            session_timeout(fd, table, &wheel, out, container_of(expired, session, timer), &tasks_count);
         }
+
+        tasks_count += flush_tasks(fd, out);
     }
 
-    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 
-    printf("Tasks sent: %d\n", tasks_count);
+    batch_free(&in);
+    batch_free(&out->batch);
+    free(out);
+    *answers = table->answers;
+    free_session_table(table);
+    return tasks_count;
 }
 
-int main(int argc, char **argv)
+typedef struct server_thread
 {
+    pthread_t tid;
+    int index;
     int fd;
+    int tasks_count;
+    answer_stats answers;
+} server_thread;
+
+void *server_thread_work(void *arg)
+{
+    server_thread *thread = arg;
+
+    // tid may not be written yet when the thread starts
+    rand_seed = time(NULL) ^ thread->index * 0x9e3779b9;
+    thread->tasks_count = do_server(thread->fd, &thread->answers);
+    return NULL;
+}
 
-    if (argc != 1)
+// Every thread owns a socket bound to the same port, the kernel spreads
+// clients between them by address hash, so a client always meets the same
+// session table. SIGINT stays blocked in the threads and is taken by the
+// main thread, which stops them with SIGUSR1.
+int do_threaded_server(int threads, answer_stats *answers)
+{
+    server_thread thread[MAX_THREADS];
+    sigset_t mask;
+    int sig, tasks_count = 0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    for (int i = 0; i < threads; i++)
+    {
+        thread[i].index = i;
+        thread[i].fd = bind_inet_socket(PORT, SOCK_DGRAM, 0, 1);
+        if (pthread_create(&thread[i].tid, NULL, server_thread_work, &thread[i]))
+            ERR("pthread_create");
+    }
+
+    while (sigwait(&mask, &sig) || sig != SIGINT);
+    do_work = 0;
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_kill(thread[i].tid, SIGUSR1))
+            ERR("pthread_kill");
+        if (pthread_join(thread[i].tid, NULL))
+            ERR("pthread_join");
+        LOG(LOG_INFO, "Thread %d sent %d tasks.\n", i, thread[i].tasks_count);
+        tasks_count += thread[i].tasks_count;
+        answers->correct += thread[i].answers.correct;
+        answers->incorrect += thread[i].answers.incorrect;
+        answers->late += thread[i].answers.late;
+        if (TEMP_FAILURE_RETRY(close(thread[i].fd)) < 0)
+            ERR("close");
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    return tasks_count;
+}
+
+int main(int argc, char **argv)
+{
+    int fd, c, threads = 1, tasks_count;
+    answer_stats answers = {0};
+
+    while ((c = getopt(argc, argv, "r:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'r':
+                max_retries = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc != optind || max_retries < 0 || threads < 1 || threads > MAX_THREADS)
     {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
     
     srand(time(NULL));
+    rand_seed = time(NULL);
     if (sethandler(SIG_IGN, SIGPIPE))
         ERR("Seting SIGPIPE");
     if (sethandler(sigint_handler, SIGINT))
         ERR("Seting SIGINT");
+    if (sethandler(sigint_handler, SIGUSR1))
+        ERR("Seting SIGUSR1");
+    log_init();
 
-    fd = bind_inet_socket(PORT, SOCK_DGRAM);;
-    do_server(fd);
+    if (threads > 1)
+        tasks_count = do_threaded_server(threads, &answers);
+    else
+    {
+        fd = bind_inet_socket(PORT, SOCK_DGRAM, 0, 0);
+        tasks_count = do_server(fd, &answers);
+        if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+            ERR("close");
+    }
 
-    if (TEMP_FAILURE_RETRY(close(fd)) < 0)
-        ERR("close");
+    log_close();
+    printf("Tasks sent: %d\n", tasks_count);
+    printf("Answers correct: %ld, incorrect: %ld, late: %ld\n", answers.correct, answers.incorrect, answers.late);
     fprintf(stderr, "Server has terminated.\n");
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include "sockio.h"
+#include <time.h>
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+#ifndef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(exp) ({ \
+   typeof (exp) _rc; \
+   do { \
+     _rc = (exp); \
+   } while (_rc == -1 && errno == EINTR); \
+   _rc; })
+#endif
+
+// Same timing as a real client
+#define LIFETIME 7000 // ms
+#define SLEEPMIN 500
+#define SLEEPMAX 2500
+
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_DURATION 10 // s
+#define MAX_EVENTS 256
+
+// Latency histogram: 16 linear sub-buckets for every power of two of microseconds
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB)
+
+volatile sig_atomic_t quit = 0;
+
+typedef enum client_state {WAIT_START, WAIT_TASK, THINK, LINGER} client_state;
+
+typedef struct virtual_client
+{
+    int fd;
+    client_state state;
+    int heap_index;
+    long wakeup; // ms, key in the timer heap
+    long cycle_start; // ready request sent, ms
+    uint64_t ready_sent_us;
+    int retransmitted; // task received again in this cycle
+    int32_t data[5];
+} virtual_client;
+
+// Binary min-heap of clients ordered by wakeup, every client is always in it
+typedef struct timer_heap
+{
+    virtual_client **items;
+    int count;
+} timer_heap;
+
+typedef struct sim_stats
+{
+    long ready_sent;
+    long tasks; // first copies of tasks received
+    long answers;
+    long retransmissions; // cycles in which the task came again
+    long drops; // ready requests never answered with a task
+    uint64_t rtt[HIST_BUCKETS];
+} sim_stats;
+
+void sigint_handler(int sig)
+{
+    quit = 1;
+}
+
+int sethandler(void (*f)(int), int sigNo)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = f;
+    if (-1 == sigaction(sigNo, &act, NULL))
+        return -1;
+    return 0;
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-n clients] [-d seconds] [-s think_scale] domain port\n", name);
+}
+
+long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+uint64_t monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void raise_fd_limit(int needed)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    if (limit.rlim_cur >= (rlim_t) needed)
+        return;
+    limit.rlim_cur = limit.rlim_max < (rlim_t) needed ? limit.rlim_max : (rlim_t) needed;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+    if (limit.rlim_cur < (rlim_t) needed)
+        fprintf(stderr, "Descriptor limit is %ld, not enough for all clients\n", (long) limit.rlim_cur);
+}
+
+void heap_swap(timer_heap *heap, int a, int b)
+{
+    virtual_client *tmp = heap->items[a];
+    heap->items[a] = heap->items[b];
+    heap->items[b] = tmp;
+    heap->items[a]->heap_index = a;
+    heap->items[b]->heap_index = b;
+}
+
+void heap_up(timer_heap *heap, int i)
+{
+    while (i > 0 && heap->items[(i - 1) / 2]->wakeup > heap->items[i]->wakeup)
+    {
+        heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void heap_down(timer_heap *heap, int i)
+{
+    while (1)
+    {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap->count && heap->items[l]->wakeup < heap->items[smallest]->wakeup)
+            smallest = l;
+        if (r < heap->count && heap->items[r]->wakeup < heap->items[smallest]->wakeup)
+            smallest = r;
+        if (smallest == i)
+            return;
+        heap_swap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+void heap_push(timer_heap *heap, virtual_client *client)
+{
+    client->heap_index = heap->count;
+    heap->items[heap->count++] = client;
+    heap_up(heap, client->heap_index);
+}
+
+// Move client's wakeup, the client stays in the heap
+void schedule(timer_heap *heap, virtual_client *client, long wakeup)
+{
+    long old = client->wakeup;
+    client->wakeup = wakeup;
+    if (wakeup < old)
+        heap_up(heap, client->heap_index);
+    else
+        heap_down(heap, client->heap_index);
+}
+
+void record_rtt(sim_stats *stats, uint64_t us)
+{
+    int bucket;
+
+    if (us < HIST_SUB)
+        bucket = us;
+    else
+    {
+        int exponent = 63 - __builtin_clzll(us);
+        bucket = (exponent - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    }
+    if (bucket >= HIST_BUCKETS)
+        bucket = HIST_BUCKETS - 1;
+    stats->rtt[bucket]++;
+}
+
+// Lowest value of a histogram bucket
+uint64_t bucket_value(int bucket)
+{
+    int exponent;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    exponent = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (1ULL << exponent) + ((uint64_t) (bucket % HIST_SUB) << (exponent - HIST_SUB_BITS));
+}
+
+uint64_t rtt_quantile(sim_stats *stats, double q)
+{
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        total += stats->rtt[i];
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += stats->rtt[i];
+        if (total && seen >= q * total)
+            return bucket_value(i);
+    }
+    return 0;
+}
+
+void prepare_ready_request(int32_t data[5])
+{
+    data[0] = htonl((int32_t) 1);
+    data[1] = data[2] = data[3] = data[4] = htonl((int32_t) 0);
+}
+
+void solve_task(int32_t data[5])
+{
+    int32_t op1 = ntohl(data[1]), op2 = ntohl(data[2]), result = 0;
+
+    switch ((char) ntohl(data[3]))
+    {
+        case '+': result = op1 + op2; break;
+        case '-': result = op1 - op2; break;
+        case '*': result = op1 * op2; break;
+    }
+    data[4] = htonl(result);
+}
+
+void send_packet(virtual_client *client, int32_t data[5])
+{
+    if (send(client->fd, data, sizeof(int32_t[5]), 0) < 0)
+    {
+        // A lost packet is what the protocol is about, keep going
+        if (errno == EAGAIN || errno == ECONNREFUSED || errno == EINTR)
+            return;
+        ERR("send");
+    }
+}
+
+void start_cycle(timer_heap *heap, sim_stats *stats, virtual_client *client, long now)
+{
+    int32_t data[5];
+
+    prepare_ready_request(data);
+    send_packet(client, data);
+    stats->ready_sent++;
+    client->state = WAIT_TASK;
+    client->cycle_start = now;
+    client->ready_sent_us = monotonic_us();
+    client->retransmitted = 0;
+    schedule(heap, client, now + LIFETIME);
+}
+
+// Timer of a client fired
+void client_timeout(timer_heap *heap, sim_stats *stats, virtual_client *client, long now)
+{
+    switch (client->state)
+    {
+        case WAIT_START:
+            start_cycle(heap, stats, client, now);
+            break;
+
+        case WAIT_TASK:
+            // Server dropped the request (or it was lost)
+            stats->drops++;
+            start_cycle(heap, stats, client, now);
+            break;
+
+        case THINK:
+            solve_task(client->data);
+            send_packet(client, client->data);
+            stats->answers++;
+            client->state = LINGER;
+            schedule(heap, client, client->cycle_start + LIFETIME);
+            break;
+
+        case LINGER:
+            start_cycle(heap, stats, client, now);
+            break;
+    }
+}
+
+void client_receive(timer_heap *heap, sim_stats *stats, virtual_client *client, long now, double think_scale)
+{
+    int32_t data[5];
+
+    while (recv(client->fd, data, sizeof(int32_t[5]), 0) == sizeof(int32_t[5]))
+    {
+        if (client->state == WAIT_TASK)
+        {
+            record_rtt(stats, monotonic_us() - client->ready_sent_us);
+            stats->tasks++;
+            memcpy(client->data, data, sizeof(client->data));
+            client->state = THINK;
+            schedule(heap, client, now + (long) (think_scale * (rand() % (SLEEPMAX - SLEEPMIN + 1) + SLEEPMIN)));
+        }
+        else if (client->state == THINK || client->state == LINGER)
+        {
+            // Retransmission, answered at once like the real client does
+            if (!client->retransmitted)
+                stats->retransmissions++;
+            client->retransmitted = 1;
+            solve_task(data);
+            send_packet(client, data);
+        }
+    }
+}
+
+void print_stats(sim_stats *stats, long elapsed)
+{
+    printf("%6.1fs ready %ld tasks %ld (%.0f/s) answers %ld retransmissions %.2f%% drops %.2f%% "
+           "rtt p50 %lu us p99 %lu us max %lu us\n",
+           elapsed / 1000.0, stats->ready_sent, stats->tasks, elapsed ? stats->tasks * 1000.0 / elapsed : 0.0,
+           stats->answers, stats->tasks ? 100.0 * stats->retransmissions / stats->tasks : 0.0,
+           stats->ready_sent ? 100.0 * stats->drops / stats->ready_sent : 0.0,
+           rtt_quantile(stats, 0.5), rtt_quantile(stats, 0.99), rtt_quantile(stats, 1.0));
+}
+
+void simulate(struct sockaddr_in addr, int count, int duration, double think_scale)
+{
+    virtual_client *clients;
+    timer_heap heap;
+    sim_stats stats;
+    struct epoll_event event, events[MAX_EVENTS];
+    long start = monotonic_ms(), end = start + duration * 1000L, report = start + 1000, now;
+    int epfd, n, timeout;
+
+    if (NULL == (clients = calloc(count, sizeof(virtual_client))) ||
+        NULL == (heap.items = calloc(count, sizeof(virtual_client *))))
+        ERR("calloc");
+    memset(&stats, 0, sizeof(stats));
+    heap.count = 0;
+
+    if ((epfd = epoll_create1(0)) < 0)
+        ERR("epoll_create1");
+
+    for (int i = 0; i < count; i++)
+    {
+        clients[i].fd = make_socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK);
+        if (connect(clients[i].fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            ERR("connect");
+        event.events = EPOLLIN;
+        event.data.ptr = &clients[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &event) < 0)
+            ERR("epoll_ctl");
+
+        // Spread the first ready requests over a second
+        clients[i].state = WAIT_START;
+        clients[i].wakeup = start + rand() % 1000;
+        heap_push(&heap, &clients[i]);
+    }
+
+    while (!quit && (now = monotonic_ms()) < end)
+    {
+        while (heap.count && heap.items[0]->wakeup <= now)
+            client_timeout(&heap, &stats, heap.items[0], now);
+
+        if (now >= report)
+        {
+            print_stats(&stats, now - start);
+            report += 1000;
+        }
+
+        timeout = heap.items[0]->wakeup - now;
+        if (timeout > report - now)
+            timeout = report - now;
+        if (timeout > end - now)
+            timeout = end - now;
+
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout < 0 ? 0 : timeout)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+
+        now = monotonic_ms();
+        for (int i = 0; i < n; i++)
+        {
+            client_receive(&heap, &stats, events[i].data.ptr, now, think_scale);
+        }
+    }
+
+    print_stats(&stats, monotonic_ms() - start);
+
+    for (int i = 0; i < count; i++)
+        if (TEMP_FAILURE_RETRY(close(clients[i].fd)) < 0)
+            ERR("close");
+    if (TEMP_FAILURE_RETRY(close(epfd)) < 0)
+        ERR("close");
+    free(heap.items);
+    free(clients);
+}
+
+int main(int argc, char **argv)
+{
+    int c, count = DEFAULT_CLIENTS, duration = DEFAULT_DURATION;
+    double think_scale = 1.0;
+
+    while ((c = getopt(argc, argv, "n:d:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 's':
+                think_scale = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || count <= 0 || duration <= 0 || think_scale < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    if (sethandler(SIG_IGN, SIGPIPE))
+        ERR("Seting SIGPIPE");
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Seting SIGINT");
+
+    raise_fd_limit(count + 16);
+    simulate(make_address(argv[optind], argv[optind + 1]), count, duration, think_scale);
+
+    fprintf(stderr, "Simulator has terminated.\n");
+    return EXIT_SUCCESS;
+}
@@ -7,12 +7,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include "histogram.h"
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -29,12 +35,75 @@
 #define PORT "2000"
 #define RANDMIN 10000000
 #define RANDMAX 100000000
+#define DEFAULT_RETRIES 1
+#define MAX_WINDOW 4096 // numbers outstanding at once
+#define BATCH_SIZE 64 // datagrams per sendmmsg/recvmmsg
+#define TICK_US 1000 // resolution of deadlines and of the send rate
+#define STATS_INTERVAL 1000000 // us between lines in flood mode
+#define TAG_WORDS 2 // request id (seq << 8 | attempt) and send time, echoed by the server
+#define MAX_TAGGED_RETRIES 254 // attempt fits the low byte of the request id
 
-volatile sig_atomic_t last_signal = 0;
+// Retransmission timeout (RFC 6298 estimator), in microseconds
+#define RTO_INITIAL 300000
+#define RTO_MIN 1000
+#define RTO_MAX 3000000
 
-void sigalrm_handler(int sig)
+typedef struct rtt_estimator
 {
-    last_signal = sig;
+    long srtt, rttvar; // srtt = 0 - no samples yet
+} rtt_estimator;
+
+typedef struct request
+{
+    int32_t data[2 + TAG_WORDS]; // job id, number, tag (network byte order)
+    long seq;
+    long sent; // first transmission
+    long deadline;
+    long rto;
+    int attempts;
+    int active;
+} request;
+
+typedef struct counters
+{
+    long generated, answered, retransmitted, lost, rtt_sum, rtt_samples;
+} counters;
+
+// Completion latency of answered numbers, from the first transmission
+typedef struct latency
+{
+    histogram first; // answered on the first attempt
+    histogram retransmitted; // answered after a retransmission
+} latency;
+
+typedef struct client
+{
+    int fd;
+    struct sockaddr_in addr;
+    long job; // < 0 - plain protocol without a job id
+    int window;
+    long count; // numbers to send, 0 - until SIGINT
+    long rate; // numbers per second, 0 - next one as soon as the window allows
+    int tagged; // numbers carry a request id and a timestamp
+    rtt_estimator rtt;
+    request slots[MAX_WINDOW]; // request seq lives in slots[seq % window]
+    long oldest, next; // seq of the oldest outstanding and of the next request
+    struct mmsghdr out[BATCH_SIZE];
+    struct iovec out_iov[BATCH_SIZE];
+    int queued;
+    struct mmsghdr in[BATCH_SIZE];
+    struct iovec in_iov[BATCH_SIZE];
+    int32_t in_data[BATCH_SIZE][3 + TAG_WORDS]; // one word more to notice longer datagrams
+    counters total;
+    latency latency;
+} client;
+
+volatile sig_atomic_t do_work = 1;
+int max_retries = DEFAULT_RETRIES;
+
+void sigint_handler(int sig)
+{
+    do_work = 0;
 }
 
 int sethandler(void (*f)(int), int sigNo)
@@ -49,98 +118,402 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s domain\n", name);
+    fprintf(stderr, "USAGE: %s [-r retries] [-j job] [-n window] [-c count] [-f rate] [-l] [-o prefix] domain\n", name);
+    fprintf(stderr, "retries - retransmissions when there is no response (default %d)\n", DEFAULT_RETRIES);
+    fprintf(stderr, "job - send the number for this job to a server started with -k,\n"
+                    "      with a window the numbers use jobs job .. job + window - 1\n");
+    fprintf(stderr, "window - numbers outstanding at once (default 1, max %d)\n", MAX_WINDOW);
+    fprintf(stderr, "count - numbers to send (default 1, with -f until SIGINT)\n");
+    fprintf(stderr, "rate - flood the server with this many numbers per second, print statistics every second\n");
+    fprintf(stderr, "-l - tag numbers with a request id and a timestamp, print latency percentiles at the end\n");
+    fprintf(stderr, "prefix - with -l, export the latency histograms to prefix.first.hgrm and prefix.retransmitted.hgrm\n");
 }
 
-int make_socket(void)
+long monotonic_us()
 {
-    int sock;
-    sock = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
 }
 
-struct sockaddr_in make_address(char *address, char *port)
+long rto_us(rtt_estimator *rtt)
 {
-    int ret;
-    struct sockaddr_in addr;
-    struct addrinfo *result;
-    struct addrinfo hints = {};
-    hints.ai_family = AF_INET;
-    if ((ret = getaddrinfo(address, port, &hints, &result)))
+    long rto;
+
+    if (rtt->srtt == 0)
+        return RTO_INITIAL;
+
+    rto = rtt->srtt + 4 * rtt->rttvar;
+    return rto < RTO_MIN ? RTO_MIN : rto > RTO_MAX ? RTO_MAX : rto;
+}
+
+void rtt_sample(rtt_estimator *rtt, long sample)
+{
+    if (sample <= 0)
+        sample = 1;
+
+    if (rtt->srtt == 0)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-        exit(EXIT_FAILURE);
+        rtt->srtt = sample;
+        rtt->rttvar = sample / 2;
+        return;
     }
-    addr = *(struct sockaddr_in *)(result->ai_addr);
-    freeaddrinfo(result);
-    return addr;
+
+    rtt->rttvar = (3 * rtt->rttvar + labs(rtt->srtt - sample)) / 4;
+    rtt->srtt = (7 * rtt->srtt + sample) / 8;
 }
 
-void send_and_receive(int fd, struct sockaddr_in addr, int32_t data, int retransmission)
+// Words before the tag, in requests and in replies
+int words(client *c)
 {
-    struct itimerval ts;
+    return c->job < 0 ? 1 : 2;
+}
 
-    if (TEMP_FAILURE_RETRY(sendto(fd, &data, sizeof(int32_t), 0, (struct sockaddr *) &addr, sizeof(addr))) < 0)
-        ERR("sendto");
-    printf("Number sent: %d\n", ntohl(data));
+void queue_send(client *c, request *r, long now)
+{
+    if (!c->rate)
+        printf("Number sent: %d\n", ntohl(r->data[1]));
+    r->data[2] = htonl((uint32_t) r->seq << 8 | r->attempts);
+    r->data[3] = htonl((uint32_t) now);
+    c->out_iov[c->queued].iov_base = c->job < 0 ? r->data + 1 : r->data;
+    c->out_iov[c->queued].iov_len = (words(c) + (c->tagged ? TAG_WORDS : 0)) * sizeof(int32_t);
+    c->queued++;
+}
 
-    if (!retransmission)
+void flush_sends(client *c)
+{
+    int sent = 0, n;
+
+    while (sent < c->queued)
     {
-        memset(&ts, 0, sizeof(struct itimerval));
-        ts.it_value.tv_usec = 300000; // 0.3s
-        setitimer(ITIMER_REAL, &ts, NULL);
-        last_signal = 0;
+        if ((n = TEMP_FAILURE_RETRY(sendmmsg(c->fd, c->out + sent, c->queued - sent, 0))) < 0)
+            ERR("sendmmsg");
+        sent += n;
     }
+    c->queued = 0;
+}
+
+void advance_oldest(client *c)
+{
+    while (c->oldest < c->next && !c->slots[c->oldest % c->window].active)
+        c->oldest++;
+}
+
+// Returns 0 when the window is full
+int start_request(client *c, long now)
+{
+    request *r = &c->slots[c->next % c->window];
+
+    if (r->active)
+        return 0;
+    r->data[0] = htonl(c->job + c->next % c->window);
+    r->data[1] = htonl(rand() % (RANDMAX - RANDMIN + 1) + RANDMIN);
+    r->seq = c->next;
+    if (!c->rate)
+        printf("Number generated: %d\n", ntohl(r->data[1]));
+    r->sent = now;
+    r->rto = rto_us(&c->rtt);
+    r->deadline = now + r->rto;
+    r->attempts = 1;
+    r->active = 1;
+    c->next++;
+    c->total.generated++;
+    queue_send(c, r, now);
+    if (c->queued == BATCH_SIZE)
+        flush_sends(c);
+    return 1;
+}
+
+// Every retransmission doubles the timeout of its request
+void expire_requests(client *c, long now)
+{
+    request *r;
 
-    int32_t rcvdata;
-    while (recv(fd, &rcvdata, sizeof(int32_t), 0) < 0)
+    for (long seq = c->oldest; seq < c->next; seq++)
     {
-        if (EINTR != errno)
-            ERR("recv");
+        r = &c->slots[seq % c->window];
+        if (!r->active || r->deadline > now)
+            continue;
+        if (r->attempts > max_retries)
+        {
+            if (!c->rate)
+                printf("No response.\n");
+            r->active = 0;
+            c->total.lost++;
+            continue;
+        }
+        r->attempts++;
+        r->rto = r->rto * 2 > RTO_MAX ? RTO_MAX : r->rto * 2;
+        r->deadline = now + r->rto;
+        c->total.retransmitted++;
+        queue_send(c, r, now);
+        if (c->queued == BATCH_SIZE)
+            flush_sends(c);
+    }
+    advance_oldest(c);
+}
+
+// A tagged reply names its request and the attempt it answers. Otherwise the
+// server ORs the number into the mask before replying, so a reply answers a
+// request whose number it covers. With job ids the slot is known, without
+// them it is the oldest covered request, or the oldest one when none is
+// (replies of server -u carry a count, not a mask).
+request *match_response(client *c, int32_t *data, unsigned len, int *attempt)
+{
+    uint32_t mask, slot, id;
+    request *r, *first = NULL;
 
-        if (SIGALRM == last_signal)
+    if (c->tagged && len == (words(c) + TAG_WORDS) * sizeof(int32_t))
+    {
+        id = ntohl(data[words(c)]);
+        r = &c->slots[(id >> 8) % c->window];
+        *attempt = id & 0xff;
+        return r->active && (id >> 8) == ((uint32_t) r->seq & 0xffffff) && *attempt <= r->attempts ? r : NULL;
+    }
+    *attempt = 0;
+    if (len != words(c) * sizeof(int32_t))
+        return NULL;
+    mask = ntohl(data[words(c) - 1]);
+    if (words(c) == 2)
+    {
+        slot = (uint32_t) ntohl(data[0]) - (uint32_t) c->job;
+        if (slot >= c->window)
+            return NULL;
+        r = &c->slots[slot];
+        return r->active && !(ntohl(r->data[1]) & ~mask) ? r : NULL;
+    }
+    for (long seq = c->oldest; seq < c->next; seq++)
+    {
+        r = &c->slots[seq % c->window];
+        if (!r->active)
+            continue;
+        if (!(ntohl(r->data[1]) & ~mask))
+            return r;
+        if (!first)
+            first = r;
+    }
+    return first;
+}
+
+// Responses to retransmitted numbers are ambiguous and not sampled (Karn's
+// rule), unless the echoed tag tells which transmission was answered
+void receive_responses(client *c, long now)
+{
+    request *r;
+    int n, attempt;
+    long rtt;
+
+    do
+    {
+        if ((n = recvmmsg(c->fd, c->in, BATCH_SIZE, MSG_DONTWAIT, NULL)) < 0)
+        {
+            if (EAGAIN == errno || EINTR == errno)
+                return;
+            ERR("recvmmsg");
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (!(r = match_response(c, c->in_data[i], c->in[i].msg_len, &attempt)))
+                continue;
+            if (attempt)
+            {
+                rtt = (uint32_t) now - (uint32_t) ntohl(c->in_data[i][words(c) + 1]);
+                histogram_record(attempt == 1 ? &c->latency.first : &c->latency.retransmitted, now - r->sent);
+            }
+            else
+                rtt = r->attempts == 1 ? now - r->sent : -1;
+            if (rtt >= 0)
+            {
+                rtt_sample(&c->rtt, rtt);
+                c->total.rtt_sum += rtt;
+                c->total.rtt_samples++;
+            }
+            if (!c->rate)
+                printf("Number received: %d\n", ntohl(c->in_data[i][words(c) - 1]));
+            r->active = 0;
+            c->total.answered++;
+        }
+    } while (n == BATCH_SIZE);
+    advance_oldest(c);
+}
+
+void print_counters(char *label, counters *now, counters *before, double seconds)
+{
+    long samples = now->rtt_samples - before->rtt_samples;
+    printf("%s sent: %.0f/s, answered: %.0f/s, retransmitted: %ld, lost: %ld, rtt: %ld us\n", label,
+           (now->generated - before->generated) / seconds, (now->answered - before->answered) / seconds,
+           now->retransmitted - before->retransmitted, now->lost - before->lost,
+           samples ? (now->rtt_sum - before->rtt_sum) / samples : 0);
+}
+
+void client_init(client *c, int fd, struct sockaddr_in addr)
+{
+    c->fd = fd;
+    c->addr = addr;
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        c->out[i].msg_hdr.msg_name = &c->addr;
+        c->out[i].msg_hdr.msg_namelen = sizeof(c->addr);
+        c->out[i].msg_hdr.msg_iov = &c->out_iov[i];
+        c->out[i].msg_hdr.msg_iovlen = 1;
+        c->in_iov[i].iov_base = c->in_data[i];
+        c->in_iov[i].iov_len = sizeof(c->in_data[i]);
+        c->in[i].msg_hdr.msg_iov = &c->in_iov[i];
+        c->in[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+// Keeps up to window numbers outstanding, each with its own deadline. One
+// periodic timerfd drives both the deadlines and the send rate.
+void do_client(client *c)
+{
+    struct itimerspec tick = {{0, TICK_US * 1000}, {0, TICK_US * 1000}};
+    struct pollfd fds[2];
+    counters last = {0};
+    long start = monotonic_us(), report = start + STATS_INTERVAL, now;
+    uint64_t expirations;
+    int tfd;
+
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+        ERR("timerfd_create");
+    if (timerfd_settime(tfd, 0, &tick, NULL))
+        ERR("timerfd_settime");
+    fds[0].fd = c->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = tfd;
+    fds[1].events = POLLIN;
+
+    while (do_work)
+    {
+        now = monotonic_us();
+        while ((!c->count || c->next < c->count) &&
+               (!c->rate || c->next < (now - start) * (double) c->rate / 1000000) && start_request(c, now))
+            ;
+        flush_sends(c);
+        if (c->count && c->next == c->count && c->oldest == c->next)
+            break;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERR("poll");
+        }
+        if (fds[0].revents & POLLIN)
+            receive_responses(c, monotonic_us());
+        if (fds[1].revents & POLLIN)
+        {
+            if (read(tfd, &expirations, sizeof(expirations)) < 0 && EAGAIN != errno)
+                ERR("read");
+            expire_requests(c, monotonic_us());
+        }
+        flush_sends(c);
+
+        if (c->rate && (now = monotonic_us()) >= report)
         {
-            send_and_receive(fd, addr, data, 1);
-            return;
+            print_counters("Interval", &c->total, &last, STATS_INTERVAL / 1000000.0);
+            last = c->total;
+            report += STATS_INTERVAL;
         }
     }
 
-    // Received data
-    printf("Number received: %d\n", ntohl(rcvdata));
+    if (c->rate || c->count != 1)
+    {
+        memset(&last, 0, sizeof(last));
+        print_counters("Total", &c->total, &last, (monotonic_us() - start) / 1000000.0);
+        printf("Numbers: %ld, answered: %ld, lost: %ld\n", c->total.generated, c->total.answered, c->total.lost);
+    }
+    if (c->tagged)
+    {
+        histogram_print(stdout, "Latency (us), first attempt", &c->latency.first);
+        histogram_print(stdout, "Latency (us), retransmitted", &c->latency.retransmitted);
+    }
+    if (TEMP_FAILURE_RETRY(close(tfd)) < 0)
+        ERR("close");
 }
 
-void do_client(int fd, struct sockaddr_in addr)
+void export_histogram(char *prefix, char *name, histogram *h)
 {
-    int32_t data = htonl(rand() % (RANDMAX - RANDMIN + 1) + RANDMIN);
-    printf("Number generated: %d\n", ntohl(data));
-    send_and_receive(fd, addr, data, 0);
+    char path[PATH_MAX];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.%s.hgrm", prefix, name);
+    if (NULL == (f = fopen(path, "w")))
+        ERR("fopen");
+    histogram_export(f, h);
+    if (fclose(f))
+        ERR("fclose");
 }
 
 int main(int argc, char **argv)
 {
-    int fd;
-    struct sockaddr_in addr;
+    static client cl;
+    int fd, c, count_set = 0;
+    long job = -1;
+    char *prefix = NULL;
 
-    if (argc != 2)
+    cl.window = 1;
+    cl.count = 1;
+    while ((c = getopt(argc, argv, "r:j:n:c:f:lo:")) != -1)
+    {
+        switch (c)
+        {
+            case 'r':
+                max_retries = atoi(optarg);
+                break;
+            case 'j':
+                job = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                cl.window = atoi(optarg);
+                break;
+            case 'c':
+                cl.count = atol(optarg);
+                count_set = 1;
+                break;
+            case 'f':
+                cl.rate = atol(optarg);
+                break;
+            case 'l':
+                cl.tagged = 1;
+                break;
+            case 'o':
+                prefix = optarg;
+                cl.tagged = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1 || max_retries < 0 || cl.window < 1 || cl.window > MAX_WINDOW || cl.count < 0 ||
+        cl.rate < 0 || (cl.tagged && max_retries > MAX_TAGGED_RETRIES))
     {
         usage(argv[0]);
         return EXIT_FAILURE;
     }
+    if (cl.rate && !count_set)
+        cl.count = 0;
 
     srand((unsigned) time(NULL) * getpid());
     if (sethandler(SIG_IGN, SIGPIPE))
         ERR("Seting SIGPIPE:");
-    if (sethandler(sigalrm_handler, SIGALRM))
-        ERR("Seting SIGALRM:");
+    if (sethandler(sigint_handler, SIGINT))
+        ERR("Seting SIGINT:");
 
-    fd = make_socket();
-    addr = make_address(argv[1], PORT);
-    do_client(fd, addr);
+    fd = make_socket(PF_INET, SOCK_DGRAM);
+    client_init(&cl, fd, make_address(argv[optind], PORT));
+    cl.job = job;
+    do_client(&cl);
+    if (prefix)
+    {
+        export_histogram(prefix, "first", &cl.latency.first);
+        export_histogram(prefix, "retransmitted", &cl.latency.retransmitted);
+    }
 
     if (TEMP_FAILURE_RETRY(close(fd)) < 0)
         ERR("close");
     fprintf(stderr, "Client has terminated.\n");
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coverage.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+coverage *coverage_create(uint64_t universe)
+{
+    coverage *c;
+
+    if (NULL == (c = malloc(sizeof(coverage))))
+        ERR("malloc");
+    c->universe = universe;
+    c->count = 0;
+    c->chunk_count = (universe + COVERAGE_CHUNK_SIZE - 1) / COVERAGE_CHUNK_SIZE;
+    if (NULL == (c->chunks = calloc(c->chunk_count, sizeof(coverage_chunk *))))
+        ERR("calloc");
+    return c;
+}
+
+void coverage_free(coverage *c)
+{
+    for (uint32_t i = 0; i < c->chunk_count; i++)
+    {
+        if (!c->chunks[i])
+            continue;
+        free(c->chunks[i]->array);
+        free(c->chunks[i]->bitmap);
+        free(c->chunks[i]);
+    }
+    free(c->chunks);
+    free(c);
+}
+
+// Values the chunk can hold, the last one may be cut by the universe
+static uint32_t chunk_span(coverage *c, uint32_t key)
+{
+    uint64_t left = c->universe - ((uint64_t) key << COVERAGE_CHUNK_BITS);
+    return left < COVERAGE_CHUNK_SIZE ? left : COVERAGE_CHUNK_SIZE;
+}
+
+static void array_to_bitmap(coverage_chunk *chunk)
+{
+    if (NULL == (chunk->bitmap = calloc(COVERAGE_CHUNK_SIZE / 64, sizeof(uint64_t))))
+        ERR("calloc");
+    for (uint32_t i = 0; i < chunk->count; i++)
+        chunk->bitmap[chunk->array[i] >> 6] |= 1ULL << (chunk->array[i] & 63);
+    free(chunk->array);
+    chunk->array = NULL;
+    chunk->capacity = 0;
+}
+
+static int array_add(coverage_chunk *chunk, uint16_t low)
+{
+    uint32_t lo = 0, hi = chunk->count, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (chunk->array[mid] < low)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < chunk->count && chunk->array[lo] == low)
+        return 0;
+
+    if (chunk->count == chunk->capacity)
+    {
+        chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 4;
+        if (NULL == (chunk->array = realloc(chunk->array, chunk->capacity * sizeof(uint16_t))))
+            ERR("realloc");
+    }
+    memmove(chunk->array + lo + 1, chunk->array + lo, (chunk->count - lo) * sizeof(uint16_t));
+    chunk->array[lo] = low;
+    chunk->count++;
+    return 1;
+}
+
+// The count follows the popcount of the changed word, the same bookkeeping
+// works for adding a whole word of values at once
+static int bitmap_add(coverage_chunk *chunk, uint16_t low)
+{
+    uint64_t *word = &chunk->bitmap[low >> 6], old = *word;
+
+    *word |= 1ULL << (low & 63);
+    chunk->count += __builtin_popcountll(*word) - __builtin_popcountll(old);
+    return *word != old;
+}
+
+int coverage_add(coverage *c, uint32_t value)
+{
+    uint32_t key = value >> COVERAGE_CHUNK_BITS, span;
+    uint16_t low = value & (COVERAGE_CHUNK_SIZE - 1);
+    coverage_chunk *chunk;
+    int added;
+
+    if (value >= c->universe)
+        return 0;
+
+    if (NULL == (chunk = c->chunks[key]))
+    {
+        if (NULL == (chunk = c->chunks[key] = calloc(1, sizeof(coverage_chunk))))
+            ERR("calloc");
+    }
+
+    span = chunk_span(c, key);
+    if (chunk->count == span)
+        return 0;
+
+    if (chunk->bitmap)
+        added = bitmap_add(chunk, low);
+    else
+    {
+        added = array_add(chunk, low);
+        if (chunk->count == COVERAGE_ARRAY_MAX && chunk->count < span)
+            array_to_bitmap(chunk);
+    }
+
+    // A full chunk needs no storage
+    if (chunk->count == span)
+    {
+        free(chunk->array);
+        free(chunk->bitmap);
+        chunk->array = NULL;
+        chunk->bitmap = NULL;
+        chunk->capacity = 0;
+    }
+
+    c->count += added;
+    return added;
+}
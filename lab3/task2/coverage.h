@@ -0,0 +1,43 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdint.h>
+
+// Set of values seen out of the universe [0, universe), universe <= 2^32.
+// Values are split by their high 16 bits into chunks (roaring bitmap
+// layout). A chunk is a sorted array while it is sparse, a bitmap once it
+// holds COVERAGE_ARRAY_MAX values, and nothing at all once it is full, so
+// memory follows the values actually received.
+
+#define COVERAGE_CHUNK_BITS 16
+#define COVERAGE_CHUNK_SIZE (1 << COVERAGE_CHUNK_BITS)
+#define COVERAGE_ARRAY_MAX 4096 // an array this long takes as much as a bitmap
+
+typedef struct coverage_chunk
+{
+    uint32_t count; // values present
+    uint32_t capacity; // of array
+    uint16_t *array; // sorted, NULL for bitmap and full chunks
+    uint64_t *bitmap; // COVERAGE_CHUNK_SIZE bits
+} coverage_chunk;
+
+typedef struct coverage
+{
+    uint64_t universe;
+    uint64_t count; // distinct values seen
+    uint32_t chunk_count;
+    coverage_chunk **chunks; // NULL until the first value of a chunk
+} coverage;
+
+coverage *coverage_create(uint64_t universe);
+void coverage_free(coverage *c);
+
+// Returns 1 if value was not seen before, values outside the universe are ignored
+int coverage_add(coverage *c, uint32_t value);
+
+static inline int coverage_complete(coverage *c)
+{
+    return c->count == c->universe;
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "histogram.h"
+
+static uint32_t bucket_index(uint64_t value)
+{
+    int shift;
+
+    if (value < HISTOGRAM_SUB)
+        return value;
+    shift = 63 - __builtin_clzll(value) - HISTOGRAM_PRECISION;
+    return ((shift + 1) << HISTOGRAM_PRECISION) + (value >> shift) - HISTOGRAM_SUB;
+}
+
+// Highest value counted in the bucket
+static uint64_t bucket_value(uint32_t index)
+{
+    int shift;
+
+    if (index < HISTOGRAM_SUB)
+        return index;
+    shift = (index >> HISTOGRAM_PRECISION) - 1;
+    return ((uint64_t) ((index & (HISTOGRAM_SUB - 1)) + HISTOGRAM_SUB + 1) << shift) - 1;
+}
+
+void histogram_record(histogram *h, uint64_t value)
+{
+    if (value > UINT32_MAX)
+        value = UINT32_MAX;
+    h->counts[bucket_index(value)]++;
+    if (!h->total || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+}
+
+uint64_t histogram_percentile(histogram *h, double p)
+{
+    uint64_t rank = p / 100 * h->total + 0.5, seen = 0;
+
+    if (rank < 1)
+        rank = 1;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        if ((seen += h->counts[i]) >= rank)
+            return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+    return h->max;
+}
+
+void histogram_print(FILE *f, char *label, histogram *h)
+{
+    if (!h->total)
+    {
+        fprintf(f, "%s: no samples\n", label);
+        return;
+    }
+    fprintf(f, "%s: count %lu, min %lu, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu, mean %.1f\n", label,
+            h->total, h->min, histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99),
+            histogram_percentile(h, 99.9), h->max, (double) h->sum / h->total);
+}
+
+// Every non-empty bucket is one row, plotting tools only need the rows to
+// grow in both value and percentile
+void histogram_export(FILE *f, histogram *h)
+{
+    uint64_t seen = 0;
+    double percentile;
+
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if (!h->counts[i])
+            continue;
+        seen += h->counts[i];
+        percentile = (double) seen / h->total;
+        if (seen < h->total)
+            fprintf(f, "%12lu %14.12f %10lu %14.2f\n", bucket_value(i), percentile, seen, 1 / (1 - percentile));
+        else
+            fprintf(f, "%12lu %14.12f %10lu\n", h->max, percentile, seen);
+    }
+    fprintf(f, "#[Mean    = %12.3f, Max            = %12lu]\n", h->total ? (double) h->sum / h->total : 0.0, h->max);
+    fprintf(f, "#[Total count    = %12lu, SubBuckets     = %12d]\n", h->total, HISTOGRAM_SUB);
+}
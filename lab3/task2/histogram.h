@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Latency histogram in the HDR layout. Values below 2^HISTOGRAM_PRECISION
+// are counted exactly, above that every power of two is split into
+// 2^HISTOGRAM_PRECISION equal buckets, so any value is kept with a relative
+// error under 1%. Recording is an index computation and one increment.
+
+#define HISTOGRAM_PRECISION 7
+#define HISTOGRAM_SUB (1 << HISTOGRAM_PRECISION)
+#define HISTOGRAM_MAX_BITS 32 // values are clamped to 2^32 - 1
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_PRECISION + 1) * HISTOGRAM_SUB)
+
+typedef struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total, sum, min, max;
+} histogram;
+
+void histogram_record(histogram *h, uint64_t value);
+
+// Highest value equivalent to the one at percentile p (0 - 100)
+uint64_t histogram_percentile(histogram *h, double p);
+
+// One line: count, min, percentiles, max and mean
+void histogram_print(FILE *f, char *label, histogram *h);
+
+// Percentile distribution in the text format of HdrHistogram (.hgrm)
+void histogram_export(FILE *f, histogram *h);
+
+#endif
@@ -13,6 +13,17 @@
 #include <signal.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include "binlog.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include "coverage.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -27,8 +38,65 @@
 #endif
 
 #define PORT 2000
-#define BACKLOG 3
 #define MASKLENGTH 27 // 8 digit number requires at most 27 bits
+#define BATCH_SIZE 256 // datagrams per recvmmsg/sendmmsg
+#define TAG_WORDS 2 // request id and timestamp after a number, echoed after the reply
+#define MAX_THREADS 64
+#define JOB_INDEX_BITS 17
+#define JOB_INDEX_SIZE (1 << JOB_INDEX_BITS)
+#define MAX_JOBS (JOB_INDEX_SIZE / 2) // keeps probes short
+#define JOB_IDLE 60 // seconds without a number before a job is forgotten
+#define JOB_SWEEP 64 // slots checked for idle jobs per batch
+#define STATE_MAGIC 0x314b534d // "MSK1"
+#define SYNC_INTERVAL_MS 1000 // longest a change waits for msync while datagrams arrive
+#define SYNC_THRESHOLD 4096 // changes that force an earlier msync
+#define STATE_HEADER_SIZE 4096 // a page, the job table is mapped after it
+
+#define JOB_EMPTY 0
+#define JOB_ACTIVE 1
+#define JOB_COMPLETE 2
+
+// 16 bytes, four jobs share a cache line
+typedef struct job
+{
+    uint32_t id;
+    uint32_t mask;
+    uint32_t last_seen; // seconds of job time, see mask_state.epoch
+    uint32_t state;
+} job;
+
+// Open addressing with linear probing, removals shift the following
+// entries back so there are no tombstones
+typedef struct job_table
+{
+    job slots[JOB_INDEX_SIZE];
+    uint32_t count;
+    uint32_t hand; // next slot checked for idle jobs
+    long completed, expired, rejected;
+} job_table;
+
+// Everything the server accumulates, kept in a mapping so it can live in a
+// file (-s) and be picked up again after a restart. The header takes the
+// first page of the file, the job table follows it and is mapped in keyed
+// mode only.
+typedef struct mask_state
+{
+    uint32_t magic;
+    uint32_t masklength;
+    uint32_t mask;
+    uint32_t dirty; // changes since the last msync
+    uint64_t synced; // ms, CLOCK_MONOTONIC
+    int64_t epoch; // CLOCK_MONOTONIC seconds at job time 0 in this run, set once at open
+    uint32_t clock; // job time at the last msync, a resumed run continues from it
+    job_table *jobs; // keyed mode, only valid in this run
+} mask_state;
+
+volatile sig_atomic_t do_work = 1;
+
+void sigint_handler(int sig)
+{
+    do_work = 0;
+}
 
 int sethandler(void (*f)(int), int sigNo)
 {
@@ -42,78 +110,651 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s\n", name);
+    fprintf(stderr, "USAGE: %s [-b] [-u universe] [-t threads] [-k] [-s state]\n", name);
+    fprintf(stderr, "-b - receive and answer numbers in batches, print one line per batch\n");
+    fprintf(stderr, "-u - instead of the bit mask collect distinct numbers from [0, universe), universe <= 2^32,\n"
+                    "     answer with the number of values seen\n");
+    fprintf(stderr, "-t - batched mask mode on threads SO_REUSEPORT sockets (max %d)\n", MAX_THREADS);
+    fprintf(stderr, "-k - datagrams carry a job id before the number, every job has its own mask, runs until SIGINT\n");
+    fprintf(stderr, "-s - keep the mask (or the jobs) in this file and resume from it on start, not with -u\n");
 }
 
-int make_socket(int domain, int type)
+uint32_t monotonic_seconds()
 {
-    int sock;
-    sock = socket(domain, type, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
 }
 
-int bind_inet_socket(uint16_t port, int type)
+uint64_t monotonic_ms()
 {
-    struct sockaddr_in addr;
-    int socketfd, t = 1;
-    socketfd = make_socket(PF_INET, type);
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
-        ERR("setsockopt");
-    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        ERR("bind");
-    if (SOCK_STREAM == type)
-        if (listen(socketfd, BACKLOG) < 0)
-            ERR("listen");
-    return socketfd;
-}
-
-void do_server(int fd)
-{
-    int32_t data, mask = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Seconds that keep counting across restarts of a state file
+uint32_t job_clock(mask_state *state)
+{
+    return (int64_t) monotonic_seconds() - state->epoch;
+}
+
+void state_changed(mask_state *state, uint32_t changes)
+{
+    __atomic_add_fetch(&state->dirty, changes, __ATOMIC_RELAXED);
+}
+
+// Write pending changes back unless the last msync was recent and few changes
+// piled up since. Costs a clock read when there is nothing to do, may be
+// called by many threads at once.
+void state_sync(mask_state *state, int force)
+{
+    uint32_t dirty = __atomic_load_n(&state->dirty, __ATOMIC_RELAXED);
+    uint64_t now, synced;
+
+    if (!dirty)
+        return;
+    now = monotonic_ms();
+    synced = __atomic_load_n(&state->synced, __ATOMIC_RELAXED);
+    if (!force && dirty < SYNC_THRESHOLD && now - synced < SYNC_INTERVAL_MS)
+        return;
+    if (!__atomic_compare_exchange_n(&state->synced, &synced, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return; // another thread is syncing
+
+    __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    state->clock = job_clock(state);
+    if (msync(state, STATE_HEADER_SIZE, MS_SYNC))
+        ERR("msync");
+    // Only the pages written since the last msync go to the disk
+    if (state->jobs && msync(state->jobs, sizeof(job_table), MS_SYNC))
+        ERR("msync");
+}
+
+void *map_state(int fd, size_t size, off_t offset)
+{
+    void *p;
+
+    if (MAP_FAILED == (p = mmap(NULL, size, PROT_READ | PROT_WRITE, fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED,
+                                fd, offset)))
+        ERR("mmap");
+    return p;
+}
+
+// Map the state file, a new one is created, an existing one is resumed.
+// Without a path the state is anonymous memory. A file of a mask run used
+// with -k grows an empty job table, a job table is ignored without -k.
+mask_state *open_state(char *path, int keyed)
+{
+    mask_state *state;
+    struct stat st;
+    off_t size = STATE_HEADER_SIZE + (keyed ? sizeof(job_table) : 0);
+    int fd;
+
+    if (!path)
+    {
+        state = map_state(-1, STATE_HEADER_SIZE, 0);
+        state->magic = STATE_MAGIC;
+        state->masklength = MASKLENGTH;
+        state->epoch = monotonic_seconds();
+        if (keyed)
+            state->jobs = map_state(-1, sizeof(job_table), 0);
+        return state;
+    }
+
+    if ((fd = TEMP_FAILURE_RETRY(open(path, O_RDWR | O_CREAT, 0600))) < 0)
+        ERR("open");
+    if (fstat(fd, &st))
+        ERR("fstat");
+    if (st.st_size != 0 && st.st_size != STATE_HEADER_SIZE && st.st_size != STATE_HEADER_SIZE + sizeof(job_table))
+    {
+        fprintf(stderr, "%s is not a state file of this server\n", path);
+        exit(EXIT_FAILURE);
+    }
+    // The file stays sparse, pages of the job table appear as jobs use them
+    if (st.st_size < size && ftruncate(fd, size))
+        ERR("ftruncate");
+    state = map_state(fd, STATE_HEADER_SIZE, 0);
+    state->jobs = keyed ? map_state(fd, sizeof(job_table), STATE_HEADER_SIZE) : NULL;
+    if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+        ERR("close");
+
+    if (st.st_size == 0)
+    {
+        state->masklength = MASKLENGTH;
+        state->epoch = monotonic_seconds();
+        state->magic = STATE_MAGIC;
+        if (msync(state, STATE_HEADER_SIZE, MS_SYNC))
+            ERR("msync");
+        return state;
+    }
+    if (state->magic != STATE_MAGIC || state->masklength != MASKLENGTH)
+    {
+        fprintf(stderr, "%s is not a state file of this server\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Job time goes on from the last msync, the monotonic clock does not
+    // survive a reboot. Nothing but the header is touched.
+    state->epoch = (int64_t) monotonic_seconds() - state->clock;
+    state->dirty = 0;
+    state->synced = monotonic_ms();
+    printf("Resumed from %s, mask: %u, jobs: %u\n", path, state->mask, state->jobs ? state->jobs->count : 0);
+    return state;
+}
+
+void close_state(mask_state *state)
+{
+    if (state->jobs && munmap(state->jobs, sizeof(job_table)))
+        ERR("munmap");
+    if (munmap(state, STATE_HEADER_SIZE))
+        ERR("munmap");
+}
+
+// Answer in coverage mode, the count saturates for a 2^32 universe
+uint32_t covered(coverage *cov)
+{
+    return cov->count > UINT32_MAX ? UINT32_MAX : cov->count;
+}
+
+// Collects numbers into the bit mask, or into cov when it is given
+void do_server(int fd, coverage *cov, mask_state *state)
+{
+    int32_t data[1 + TAG_WORDS], number;
     struct sockaddr_in addr;
     socklen_t size = sizeof(addr);
+    ssize_t len;
     
     while (1)
     {
-        if (TEMP_FAILURE_RETRY(recvfrom(fd, &data, sizeof(int32_t), 0, (struct sockaddr *) &addr, &size)) < 0)
+        if ((len = TEMP_FAILURE_RETRY(recvfrom(fd, data, sizeof(data), 0, (struct sockaddr *) &addr, &size))) < 0)
             ERR("recvfrom");
 
-        data = ntohl(data);
-        printf("Number received: %d\n", data);
-        mask = mask | data;
+        number = ntohl(data[0]);
+        LOG(LOG_DEBUG, "Number received: %d\n", number);
+        if (cov)
+            coverage_add(cov, number);
+        else if (number & ~state->mask)
+        {
+            state->mask |= number;
+            state_changed(state, 1);
+        }
+        state_sync(state, 0);
 
         int send = (rand() % 10 + 1) <= 7 ? 1 : 0;
         if (!send)
             continue;
 
-        int32_t data = htonl(mask);
-        if (TEMP_FAILURE_RETRY(sendto(fd, &data, sizeof(int32_t), 0, (struct sockaddr *) &addr, size)) < 0)
+        // A tagged number gets its tag back after the reply
+        uint32_t reply = cov ? covered(cov) : state->mask;
+        data[0] = htonl(reply);
+        len = len == sizeof(data) ? sizeof(data) : sizeof(int32_t);
+        if (TEMP_FAILURE_RETRY(sendto(fd, data, len, 0, (struct sockaddr *) &addr, size)) < 0)
         {
             if (ECONNRESET == errno)
                 continue;
             ERR("send");
         }
-        printf("Number sent: %d\n", mask);
+        LOG(LOG_DEBUG, "Number sent: %u\n", reply);
 
-        if (mask == ~(~0 << MASKLENGTH))
+        if (cov ? coverage_complete(cov) : state->mask == ~(~0U << MASKLENGTH))
         {
-            printf("Stop processing.\n");
+            LOG(LOG_INFO, "Stop processing.\n");
             break;
         }
     }
+    state_sync(state, 1);
 }
 
-int main(int argc, char **argv)
+// xorshift32, cheaper than rand() which takes a lock on every call
+uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// OR of n words. Byte order does not matter to OR, so numbers are reduced
+// in network order and only the result is swapped.
+uint32_t or_reduce(const uint32_t *words, int n)
+{
+    uint32_t result = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (words + i)));
+    __m128i half = _mm_or_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_or_si128(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_or_si128(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtsi128_si32(half);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (words + i)));
+    acc = _mm_or_si128(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_or_si128(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < n; i++)
+        result |= words[i];
+    return result;
+}
+
+typedef struct number_batch
+{
+    uint32_t numbers[BATCH_SIZE]; // network order
+    uint32_t tags[BATCH_SIZE][TAG_WORDS]; // scattered apart so numbers stay contiguous
+    struct sockaddr_in addr[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE][2];
+    struct mmsghdr msgs[BATCH_SIZE], replies[BATCH_SIZE];
+    struct iovec reply_iov[BATCH_SIZE][2];
+    uint32_t reply; // shared by all replies of a batch
+} number_batch;
+
+void batch_init(number_batch *batch)
+{
+    memset(batch, 0, sizeof(number_batch));
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        batch->iov[i][0].iov_base = &batch->numbers[i];
+        batch->iov[i][0].iov_len = sizeof(uint32_t);
+        batch->iov[i][1].iov_base = batch->tags[i];
+        batch->iov[i][1].iov_len = sizeof(batch->tags[i]);
+        batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 2;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+        batch->reply_iov[i][0].iov_base = &batch->reply;
+        batch->reply_iov[i][0].iov_len = sizeof(uint32_t);
+        batch->reply_iov[i][1] = batch->iov[i][1];
+    }
+}
+
+// Receive up to BATCH_SIZE numbers, returns how many datagrams arrived
+int receive_numbers(int fd, number_batch *batch, int flags)
+{
+    int received;
+
+    for (int i = 0; i < BATCH_SIZE; i++)
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    if ((received = TEMP_FAILURE_RETRY(recvmmsg(fd, batch->msgs, BATCH_SIZE, flags, NULL))) < 0)
+    {
+        if (EAGAIN == errno || EWOULDBLOCK == errno)
+            return 0;
+        ERR("recvmmsg");
+    }
+
+    // Datagrams that are not a single number, tagged or not, do not count
+    for (int i = 0; i < received; i++)
+        if ((batch->msgs[i].msg_len != sizeof(uint32_t) &&
+             batch->msgs[i].msg_len != sizeof(uint32_t) * (1 + TAG_WORDS)) ||
+            (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+            batch->numbers[i] = 0;
+    return received;
+}
+
+// Answer about 70% of the received datagrams with value, returns how many
+int send_replies(int fd, number_batch *batch, int received, uint32_t value, uint32_t *random)
+{
+    int count = 0, sent, n;
+
+    batch->reply = htonl(value);
+    for (int i = 0; i < received; i++)
+    {
+        batch->replies[count].msg_hdr = batch->msgs[i].msg_hdr;
+        batch->replies[count].msg_hdr.msg_iov = batch->reply_iov[i];
+        batch->replies[count].msg_hdr.msg_iovlen = batch->msgs[i].msg_len == sizeof(uint32_t) * (1 + TAG_WORDS) ? 2 : 1;
+        count += next_random(random) % 10 < 7;
+    }
+    for (sent = 0; sent < count; sent += n > 0 ? n : 1)
+        if ((n = TEMP_FAILURE_RETRY(sendmmsg(fd, batch->replies + sent, count - sent, 0))) < 0 && ECONNRESET != errno)
+            ERR("sendmmsg");
+    return count;
+}
+
+// Receive up to BATCH_SIZE numbers per recvmmsg, fold them into the mask at
+// once and answer about 70% of them with one sendmmsg. Every reply of a batch
+// carries the mask after the whole batch.
+void do_batch_server(int fd, coverage *cov, mask_state *state)
+{
+    static number_batch batch;
+    uint32_t bits, random = time(NULL) * getpid() | 1;
+    int received, count;
+
+    batch_init(&batch);
+    while (1)
+    {
+        received = receive_numbers(fd, &batch, MSG_WAITFORONE);
+        if (cov)
+            for (int i = 0; i < received; i++)
+                coverage_add(cov, ntohl(batch.numbers[i]));
+        else if ((bits = ntohl(or_reduce(batch.numbers, received))) & ~state->mask)
+        {
+            state->mask |= bits;
+            state_changed(state, 1);
+        }
+        state_sync(state, 0);
+
+        count = send_replies(fd, &batch, received, cov ? covered(cov) : state->mask, &random);
+        LOG(LOG_DEBUG, "Numbers received: %d, sent: %d, %s: %u\n", received, count, cov ? "covered" : "mask",
+            cov ? covered(cov) : state->mask);
+
+        if (cov ? coverage_complete(cov) : state->mask == ~(~0U << MASKLENGTH))
+        {
+            LOG(LOG_INFO, "Stop processing.\n");
+            break;
+        }
+    }
+    state_sync(state, 1);
+}
+
+typedef struct mask_thread
 {
+    pthread_t tid;
+    mask_state *state; // mask updated with atomic OR by all threads
     int fd;
+    int stop_fd; // read end of a pipe closed once the mask is complete
+    int stop_write;
+    int *stopped; // shared, set by the thread closing stop_write
+    long received, sent;
+} mask_thread;
+
+// Batched loop sharing the mask with other threads. The first thread to see
+// the mask complete (its own OR or one resumed complete from the state file)
+// announces the end and closes the stop pipe, which wakes everybody else.
+void *mask_thread_work(void *arg)
+{
+    mask_thread *thread = arg;
+    number_batch *batch;
+    struct pollfd fds[2] = {{thread->fd, POLLIN, 0}, {thread->stop_fd, POLLIN, 0}};
+    uint32_t full = ~(~0U << MASKLENGTH), bits, old, random = (time(NULL) ^ (uintptr_t) thread) | 1;
+    int received;
+
+    if (NULL == (batch = malloc(sizeof(number_batch))))
+        ERR("malloc");
+    batch_init(batch);
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERR("poll");
+        }
+        if (fds[1].revents)
+            break;
+        if (0 == (received = receive_numbers(thread->fd, batch, MSG_DONTWAIT)))
+            continue;
+        thread->received += received;
+
+        // Bits already set do not need the cache line in exclusive state
+        bits = ntohl(or_reduce(batch->numbers, received));
+        old = __atomic_load_n(&thread->state->mask, __ATOMIC_RELAXED);
+        if (bits & ~old)
+        {
+            old = __atomic_fetch_or(&thread->state->mask, bits, __ATOMIC_RELAXED);
+            state_changed(thread->state, 1);
+        }
+        state_sync(thread->state, 0);
+
+        thread->sent += send_replies(thread->fd, batch, received, old | bits, &random);
+
+        if ((old | bits) == full)
+        {
+            if (!__atomic_exchange_n(thread->stopped, 1, __ATOMIC_ACQ_REL))
+            {
+                LOG(LOG_INFO, "Stop processing.\n");
+                state_sync(thread->state, 1);
+                if (TEMP_FAILURE_RETRY(close(thread->stop_write)) < 0)
+                    ERR("close");
+            }
+            break;
+        }
+    }
+
+    free(batch);
+    return NULL;
+}
+
+// Every thread owns a SO_REUSEPORT socket bound to the same port, the kernel
+// spreads clients between them by address hash
+void do_threaded_server(int threads, mask_state *state)
+{
+    mask_thread thread[MAX_THREADS];
+    int stop[2], stopped = 0;
+
+    if (pipe(stop))
+        ERR("pipe");
+    for (int i = 0; i < threads; i++)
+    {
+        thread[i].fd = bind_inet_socket(PORT, SOCK_DGRAM, 0, 1);
+        thread[i].state = state;
+        thread[i].stop_fd = stop[0];
+        thread[i].stop_write = stop[1];
+        thread[i].stopped = &stopped;
+        thread[i].received = thread[i].sent = 0;
+        if (pthread_create(&thread[i].tid, NULL, mask_thread_work, &thread[i]))
+            ERR("pthread_create");
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_join(thread[i].tid, NULL))
+            ERR("pthread_join");
+        LOG(LOG_INFO, "Thread %d received %ld numbers, sent %ld.\n", i, thread[i].received, thread[i].sent);
+        if (TEMP_FAILURE_RETRY(close(thread[i].fd)) < 0)
+            ERR("close");
+    }
+    if (TEMP_FAILURE_RETRY(close(stop[0])) < 0)
+        ERR("close");
+    state_sync(state, 1);
+}
+
+uint32_t job_hash(uint32_t id)
+{
+    return (id * 2654435761U) >> (32 - JOB_INDEX_BITS);
+}
+
+// Job with the given id, a new one if there is room, NULL otherwise
+job *job_get(job_table *table, uint32_t id)
+{
+    uint32_t i;
+
+    for (i = job_hash(id); table->slots[i].state != JOB_EMPTY; i = (i + 1) & (JOB_INDEX_SIZE - 1))
+        if (table->slots[i].id == id)
+            return &table->slots[i];
+
+    if (table->count == MAX_JOBS)
+        return NULL;
+    table->slots[i].id = id;
+    table->slots[i].mask = 0;
+    table->slots[i].state = JOB_ACTIVE;
+    table->count++;
+    return &table->slots[i];
+}
+
+void job_remove(job_table *table, uint32_t i)
+{
+    uint32_t j = i, home;
+
+    while (1)
+    {
+        j = (j + 1) & (JOB_INDEX_SIZE - 1);
+        if (table->slots[j].state == JOB_EMPTY)
+            break;
+        // Move j into the hole unless its probe starts after the hole
+        home = job_hash(table->slots[j].id);
+        if (((j - home) & (JOB_INDEX_SIZE - 1)) >= ((j - i) & (JOB_INDEX_SIZE - 1)))
+        {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i].state = JOB_EMPTY;
+    table->count--;
+}
 
-    if (argc != 1)
+// Check the next JOB_SWEEP slots for idle jobs, returns the jobs removed
+int job_sweep(job_table *table, uint32_t now)
+{
+    int removed = 0;
+
+    for (int n = 0; n < JOB_SWEEP; n++)
+    {
+        job *j = &table->slots[table->hand];
+        if (j->state != JOB_EMPTY && now - j->last_seen >= JOB_IDLE)
+        {
+            if (j->state == JOB_ACTIVE)
+                LOG(LOG_INFO, "Job %u expired, mask: %u\n", j->id, j->mask);
+            table->expired++;
+            removed++;
+            job_remove(table, table->hand);
+            continue; // another job may have moved into this slot
+        }
+        table->hand = (table->hand + 1) & (JOB_INDEX_SIZE - 1);
+    }
+    return removed;
+}
+
+typedef struct keyed_batch
+{
+    uint32_t data[BATCH_SIZE][2 + TAG_WORDS]; // job, number, optional tag
+    uint32_t reply[BATCH_SIZE][2 + TAG_WORDS]; // job, mask, tag when the number had one
+    struct sockaddr_in addr[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE], reply_iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE], replies[BATCH_SIZE];
+} keyed_batch;
+
+void keyed_batch_init(keyed_batch *batch)
+{
+    memset(batch, 0, sizeof(keyed_batch));
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        batch->iov[i].iov_base = batch->data[i];
+        batch->iov[i].iov_len = sizeof(batch->data[i]);
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addr[i];
+        batch->reply_iov[i].iov_base = batch->reply[i];
+        batch->reply_iov[i].iov_len = sizeof(batch->reply[i]);
+    }
+}
+
+// Every datagram names its job, jobs have separate masks and complete on
+// their own. Runs until SIGINT.
+void do_keyed_server(int fd, mask_state *state)
+{
+    static keyed_batch batch;
+    job_table *table = state->jobs;
+    job *j;
+    uint32_t full = ~(~0U << MASKLENGTH), random = time(NULL) * getpid() | 1, now, jobs, old;
+    int received, count, sent, n, changes;
+
+    keyed_batch_init(&batch);
+
+    while (do_work)
+    {
+        for (int i = 0; i < BATCH_SIZE; i++)
+            batch.msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        if ((received = recvmmsg(fd, batch.msgs, BATCH_SIZE, MSG_WAITFORONE, NULL)) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERR("recvmmsg");
+        }
+
+        now = job_clock(state);
+        count = changes = 0;
+        for (int i = 0; i < received; i++)
+        {
+            if ((batch.msgs[i].msg_len != 2 * sizeof(uint32_t) && batch.msgs[i].msg_len != sizeof(batch.data[i])) ||
+                (batch.msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+                continue;
+            jobs = table->count;
+            if (NULL == (j = job_get(table, ntohl(batch.data[i][0]))))
+            {
+                table->rejected++;
+                continue;
+            }
+            changes += table->count != jobs;
+
+            // A fresh last_seen is not worth an msync, it goes with the next change
+            j->last_seen = now;
+            old = j->mask;
+            if (j->state == JOB_ACTIVE && (j->mask |= ntohl(batch.data[i][1])) == full)
+            {
+                j->state = JOB_COMPLETE;
+                table->completed++;
+                LOG(LOG_INFO, "Job %u: stop processing.\n", j->id);
+            }
+            changes += j->mask != old;
+
+            batch.reply[count][0] = batch.data[i][0];
+            batch.reply[count][1] = htonl(j->mask);
+            memcpy(batch.reply[count] + 2, batch.data[i] + 2, TAG_WORDS * sizeof(uint32_t));
+            batch.reply_iov[count].iov_len = batch.msgs[i].msg_len;
+            batch.replies[count].msg_hdr = batch.msgs[i].msg_hdr;
+            batch.replies[count].msg_hdr.msg_iov = &batch.reply_iov[count];
+            count += next_random(&random) % 10 < 7;
+        }
+
+        for (sent = 0; sent < count; sent += n > 0 ? n : 1)
+            if ((n = TEMP_FAILURE_RETRY(sendmmsg(fd, batch.replies + sent, count - sent, 0))) < 0 && ECONNRESET != errno)
+                ERR("sendmmsg");
+
+        changes += job_sweep(table, now);
+        state_changed(state, changes);
+        state_sync(state, 0);
+    }
+
+    LOG(LOG_INFO, "Jobs active: %u, completed: %ld, expired: %ld, numbers rejected: %ld\n", table->count,
+        table->completed, table->expired, table->rejected);
+    state_sync(state, 1);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, c, batch = 0, threads = 0, keyed = 0;
+    uint64_t universe = 0;
+    coverage *cov = NULL;
+    char *state_path = NULL;
+    mask_state *state;
+
+    while ((c = getopt(argc, argv, "bu:t:ks:")) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                batch = 1;
+                break;
+            case 's':
+                state_path = optarg;
+                break;
+            case 'k':
+                keyed = 1;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'u':
+                universe = strtoull(optarg, NULL, 0);
+                if (universe == 0 || universe > (1ULL << 32))
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc != optind || threads < 0 || threads > MAX_THREADS || (threads && universe) ||
+        (keyed && (threads || universe)) || (state_path && universe))
     {
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -122,12 +763,37 @@ int main(int argc, char **argv)
     srand((unsigned) time(NULL) * getpid());
     if (sethandler(SIG_IGN, SIGPIPE))
         ERR("Seting SIGPIPE");
+    // Other modes end when the mask is complete and keep the default SIGINT
+    if (keyed && sethandler(sigint_handler, SIGINT))
+        ERR("Seting SIGINT");
+    log_init();
+
+    state = open_state(state_path, keyed);
+    if (threads)
+    {
+        do_threaded_server(threads, state);
+        close_state(state);
+        log_close();
+        fprintf(stderr, "Server has terminated.\n");
+        return EXIT_SUCCESS;
+    }
 
-    fd = bind_inet_socket(PORT, SOCK_DGRAM);;
-    do_server(fd);
+    if (universe)
+        cov = coverage_create(universe);
+    fd = bind_inet_socket(PORT, SOCK_DGRAM, 0, 0);
+    if (keyed)
+        do_keyed_server(fd, state);
+    else if (batch)
+        do_batch_server(fd, cov, state);
+    else
+        do_server(fd, cov, state);
+    if (cov)
+        coverage_free(cov);
+    close_state(state);
 
     if (TEMP_FAILURE_RETRY(close(fd)) < 0)
         ERR("close");
+    log_close();
     fprintf(stderr, "Server has terminated.\n");
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -13,6 +13,9 @@
 #include <signal.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include <time.h>
+#include "query.h"
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -41,97 +44,14 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s domain port\n", name);
-}
-
-ssize_t bulk_read(int fd, char *buf, size_t count)
-{
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0 && errno == EAGAIN)
-            continue;
-        if (c < 0)
-            return c;
-        if (0 == c)
-            return len;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
-}
-
-ssize_t bulk_write(int fd, char *buf, size_t count)
-{
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
-}
-
-int make_socket(void)
-{
-    int sock;
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
-}
-
-struct sockaddr_in make_address(char *address, char *port)
-{
-    int ret;
-    struct sockaddr_in addr;
-    struct addrinfo *result;
-    struct addrinfo hints = {};
-    hints.ai_family = AF_INET;
-    if ((ret = getaddrinfo(address, port, &hints, &result)))
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-        exit(EXIT_FAILURE);
-    }
-    addr = *(struct sockaddr_in *)(result->ai_addr);
-    freeaddrinfo(result);
-    return addr;
-}
-
-int connect_socket(char *name, char *port)
-{
-    struct sockaddr_in addr;
-    int socketfd;
-    socketfd = make_socket();
-    addr = make_address(name, port);
-    if (connect(socketfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0)
-    {
-        if (errno != EINTR)
-            ERR("connect");
-        else
-        {
-            fd_set wfds;
-            int status;
-            socklen_t size = sizeof(int);
-            FD_ZERO(&wfds);
-            FD_SET(socketfd, &wfds);
-            if (TEMP_FAILURE_RETRY(select(socketfd + 1, NULL, &wfds, NULL, NULL)) < 0)
-                ERR("select");
-            if (getsockopt(socketfd, SOL_SOCKET, SO_ERROR, &status, &size) < 0)
-                ERR("getsockopt");
-            if (0 != status)
-                ERR("connect");
-        }
-    }
-    return socketfd;
+    fprintf(stderr, "USAGE: %s [-c tries] [-m] [-k k] [-q quantile] [-d] domain port\n", name);
+    fprintf(stderr, "       %s [-c tries] [-m] [-k k] [-q quantile] [-d] -u path\n", name);
+    fprintf(stderr, "tries - rounds of numbers sent (default %d), then the queries are sent\n", TRY_COUNT);
+    fprintf(stderr, "-m - query the maximum\n");
+    fprintf(stderr, "k - query the k largest numbers (max %d)\n", QUERY_TOP_MAX);
+    fprintf(stderr, "quantile - query the number at this quantile, 0 - 1\n");
+    fprintf(stderr, "-d - query the estimated count of distinct numbers\n");
+    fprintf(stderr, "path - UNIX domain socket of a server on this host (server -u)\n");
 }
 
 void prepare_data(int32_t data[DATA_SIZE])
@@ -155,6 +75,16 @@ void print_data(int32_t data[])
     }
 }
 
+// SERVER_BUSY comes instead of any answer
+void check_busy(int32_t word)
+{
+    if (word == SERVER_BUSY)
+    {
+        fprintf(stderr, "Server is busy.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
 int check_hit(int32_t rcvdata, int32_t data[])
 {
     for (int i = 0; i < DATA_SIZE; i++)
@@ -165,11 +95,36 @@ int check_hit(int32_t rcvdata, int32_t data[])
     return 0;
 }
 
-void do_client(int fd)
+// Prints the answer, see query.h
+void send_query(int fd, char *name, int32_t type, int32_t arg)
+{
+    int32_t data[DATA_SIZE] = {htonl(QUERY_MAGIC), htonl(type), htonl(arg)}, count, reply[QUERY_REPLY_MAX];
+
+    if (bulk_write(fd, (char *) data, sizeof(int32_t[DATA_SIZE])) < 0)
+        ERR("write");
+    if (bulk_read(fd, (char *) &count, sizeof(int32_t)) < (int) sizeof(int32_t))
+        ERR("read");
+    count = ntohl(count);
+    check_busy(count);
+    if (count < 0 || count > QUERY_REPLY_MAX - 1)
+    {
+        fprintf(stderr, "Invalid answer to %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (bulk_read(fd, (char *) reply, count * sizeof(int32_t)) < (int) (count * sizeof(int32_t)))
+        ERR("read");
+
+    printf("%s:", name);
+    for (int i = 0; i < count; i++)
+        printf(" %d", ntohl(reply[i]));
+    printf(count ? "\n" : " no answer\n");
+}
+
+void do_client(int fd, int tries)
 {
     int32_t data[DATA_SIZE];
     
-    for (int i = 0; i < TRY_COUNT; i++)
+    for (int i = 0; i < tries; i++)
     {
         prepare_data(data);
 
@@ -182,6 +137,7 @@ void do_client(int fd)
         if (bulk_read(fd, (char *) &rcvdata, sizeof(int32_t)) < (int)sizeof(int32_t))
             ERR("read");
         rcvdata = ntohl(rcvdata);
+        check_busy(rcvdata);
         printf("Received data (%d)\n", rcvdata);
         
         if (check_hit(rcvdata, data))
@@ -191,9 +147,39 @@ void do_client(int fd)
 
 int main(int argc, char **argv)
 {
-    int fd, flags;
+    int fd, c, tries = TRY_COUNT, max = 0, top = 0, distinct = 0;
+    double quantile = -1;
+    char *path = NULL;
+
+    while ((c = getopt(argc, argv, "c:mk:q:du:")) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                tries = atoi(optarg);
+                break;
+            case 'm':
+                max = 1;
+                break;
+            case 'k':
+                top = atoi(optarg);
+                break;
+            case 'q':
+                quantile = atof(optarg);
+                break;
+            case 'd':
+                distinct = 1;
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
 
-    if (argc != 3)
+    if (argc - optind != (path ? 0 : 2) || tries < 0 || top < 0 || top > QUERY_TOP_MAX || quantile > 1)
     {
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -203,8 +189,19 @@ int main(int argc, char **argv)
     if (sethandler(SIG_IGN, SIGPIPE))
         ERR("Seting SIGPIPE");
 
-    fd = connect_socket(argv[1], argv[2]);
-    do_client(fd);
+    if (path)
+        fd = connect_local_socket(path, SOCK_STREAM);
+    else
+        fd = connect_socket(argv[optind], argv[optind + 1], SOCK_STREAM);
+    do_client(fd, tries);
+    if (max)
+        send_query(fd, "Max", QUERY_MAX, 0);
+    if (top)
+        send_query(fd, "Top", QUERY_TOP, top);
+    if (quantile >= 0)
+        send_query(fd, "Quantile", QUERY_QUANTILE, quantile * 1000000 + 0.5);
+    if (distinct)
+        send_query(fd, "Distinct", QUERY_DISTINCT, 0);
 
     if (TEMP_FAILURE_RETRY(close(fd)) < 0)
         ERR("close");
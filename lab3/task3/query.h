@@ -0,0 +1,26 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdint.h>
+
+// Statistics queries of the max server. A request frame is still DATA_SIZE
+// words (network byte order): DATA_SIZE numbers, or the magic, a query type
+// and its argument. Numbers are never equal to the magic. The server answers
+// a query with a count followed by that many words. A count of 0 means there
+// is no answer: nothing has been received yet, or the query is invalid.
+
+#define QUERY_MAGIC 0x51525931 // "QRY1"
+
+#define QUERY_MAX 1
+#define QUERY_TOP 2 // argument: k <= QUERY_TOP_MAX, reply: k largest numbers, descending
+#define QUERY_QUANTILE 3 // argument: quantile in millionths, reply: approximate number at it
+#define QUERY_DISTINCT 4 // reply: estimated count of distinct numbers
+
+// Read by a client instead of an answer when the server has no room for it,
+// the server closes the connection right after
+#define SERVER_BUSY -1
+
+#define QUERY_TOP_MAX 64
+#define QUERY_REPLY_MAX (1 + QUERY_TOP_MAX)
+
+#endif
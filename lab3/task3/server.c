@@ -13,6 +13,10 @@
 #include <signal.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include "sockio.h"
+#include "binlog.h"
+#include <time.h>
+#include "stats.h"
 #define ERR(source) (perror(source),                                 \
                      fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                      exit(EXIT_FAILURE))
@@ -30,9 +34,35 @@
        __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
-#define BACKLOG 3
-#define MAX_CLIENTS 30
+#define BACKLOG SOMAXCONN // the kernel caps it at net.core.somaxconn
+#define MAX_CLIENTS 1000 // descriptors have to fit in fd_set
+#define DEFAULT_CLIENTS 30
+#define DEFAULT_IDLE 60 // seconds
 #define DATA_SIZE 3
+#define TICK_MS 100 // resolution of idle deadlines
+#define WHEEL_SLOTS 256 // one turn is 25.6 s, later deadlines go round again
+
+typedef struct connection
+{
+    int fd; // 0 - free slot
+    size_t filled; // bytes of frame received so far
+    int32_t frame[DATA_SIZE];
+    long deadline; // ms, CLOCK_MONOTONIC
+    int wheel_slot; // deadline may have moved on since it was linked
+    int prev, next; // timer wheel list, -1 - none
+} connection;
+
+typedef struct connections
+{
+    connection slots[MAX_CLIENTS];
+    int free[MAX_CLIENTS], free_count; // stack of free slots
+    int wheel[WHEEL_SLOTS]; // list heads
+    long tick; // last tick processed
+    int limit;
+    long idle; // ms, 0 - no timeout
+    int reserve_fd; // given up to accept and reject when out of descriptors
+    long accepted, rejected, timed_out;
+} connections;
 
 volatile sig_atomic_t do_work = 1;
 
@@ -53,103 +83,171 @@ int sethandler(void (*f)(int), int sigNo)
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s port\n", name);
+    fprintf(stderr, "USAGE: %s [-c clients] [-i idle] [-b backlog] [-u path] port\n", name);
+    fprintf(stderr, "clients - connections served at once (default %d, max %d), more are told the server is busy\n",
+            DEFAULT_CLIENTS, MAX_CLIENTS);
+    fprintf(stderr, "idle - seconds without a full frame before a connection is closed (default %d, 0 - never)\n",
+            DEFAULT_IDLE);
+    fprintf(stderr, "backlog - accept queue length (default SOMAXCONN)\n");
+    fprintf(stderr, "path - also listen on this UNIX domain socket, for clients on the same host\n");
 }
 
-ssize_t bulk_read(int fd, char *buf, size_t count)
+long monotonic_ms()
 {
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0 && errno == EAGAIN)
-            continue;
-        if (c < 0)
-            return c;
-        if (0 == c)
-            return len;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
 }
 
-ssize_t bulk_write(int fd, char *buf, size_t count)
+void initialize_clients(connections *c, int limit, long idle)
 {
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+    memset(c, 0, sizeof(connections));
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        c->free[c->free_count++] = MAX_CLIENTS - 1 - i;
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+        c->wheel[i] = -1;
+    c->tick = monotonic_ms() / TICK_MS;
+    c->limit = limit;
+    c->idle = idle;
+    if ((c->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+        ERR("open");
 }
 
-int make_socket(int domain, int type)
+void wheel_insert(connections *c, int i)
 {
-    int sock;
-    sock = socket(domain, type, 0);
-    if (sock < 0)
-        ERR("socket");
-    return sock;
+    // The tick the deadline rounds up to, so the slot is not processed before the deadline
+    long tick = (c->slots[i].deadline + TICK_MS - 1) / TICK_MS;
+    int *head = &c->wheel[c->slots[i].wheel_slot = tick % WHEEL_SLOTS];
+
+    c->slots[i].prev = -1;
+    c->slots[i].next = *head;
+    if (*head >= 0)
+        c->slots[*head].prev = i;
+    *head = i;
 }
 
-int bind_inet_socket(uint16_t port, int type)
+void wheel_remove(connections *c, int i)
 {
-    struct sockaddr_in addr;
-    int socketfd, t = 1;
-    socketfd = make_socket(PF_INET, type);
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
-        ERR("setsockopt");
-    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-        ERR("bind");
-    if (SOCK_STREAM == type)
-        if (listen(socketfd, BACKLOG) < 0)
-            ERR("listen");
-    return socketfd;
+    connection *conn = &c->slots[i];
+
+    if (conn->prev >= 0)
+        c->slots[conn->prev].next = conn->next;
+    else
+        c->wheel[conn->wheel_slot] = conn->next;
+    if (conn->next >= 0)
+        c->slots[conn->next].prev = conn->prev;
 }
 
-void initialize_clients(int client_socket[])
+// The server is full, the client reads SERVER_BUSY instead of an answer
+void reject_client(connections *c, int nfd)
 {
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    int32_t busy = htonl(SERVER_BUSY);
+
+    if (frame_write(nfd, &busy, sizeof(busy)) < 0 && EAGAIN != errno && EPIPE != errno && ECONNRESET != errno)
+        ERR("write");
+    if (TEMP_FAILURE_RETRY(close(nfd)) < 0)
+        ERR("close");
+    c->rejected++;
+}
+
+void add_client(connections *c, int nfd, long now)
+{
+    int i;
+
+    if (c->free_count == MAX_CLIENTS - c->limit || nfd >= FD_SETSIZE)
     {
-        client_socket[i] = 0;
+        reject_client(c, nfd);
+        return;
     }
+    i = c->free[--c->free_count];
+    c->slots[i].fd = nfd;
+    c->slots[i].filled = 0;
+    c->slots[i].deadline = now + c->idle;
+    if (c->idle)
+        wheel_insert(c, i);
+    c->accepted++;
+    LOG(LOG_INFO, "Added new client\n");
+}
+
+void close_client(connections *c, int i)
+{
+    if (TEMP_FAILURE_RETRY(close(c->slots[i].fd)) < 0)
+        ERR("close");
+    c->slots[i].fd = 0;
+    c->free[c->free_count++] = i;
+}
+
+void remove_client(connections *c, int i)
+{
+    if (c->idle)
+        wheel_remove(c, i);
+    close_client(c, i);
 }
 
-int accept_client(int fd)
+// Takes every pending connection until EAGAIN. Out of descriptors the
+// reserved one is released for a moment so that the connection can be
+// rejected instead of staying in the queue and waking pselect forever.
+void accept_clients(connections *c, int fd, long now)
 {
     int nfd;
-    if ((nfd = TEMP_FAILURE_RETRY(accept(fd, NULL, NULL))) < 0)
+
+    while (1)
     {
-        if (EAGAIN == errno || EWOULDBLOCK == errno)
-            return -1;
-        ERR("accept");
+        if ((nfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+            add_client(c, nfd, now);
+            continue;
+        }
+        switch (errno)
+        {
+            case EAGAIN:
+                return;
+            case EINTR:
+            case ECONNABORTED:
+            case EPROTO:
+                continue;
+            case EMFILE:
+            case ENFILE:
+                if (TEMP_FAILURE_RETRY(close(c->reserve_fd)) < 0)
+                    ERR("close");
+                if ((nfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    reject_client(c, nfd);
+                if ((c->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+                    ERR("open");
+                if (nfd < 0)
+                    return;
+                continue;
+            default:
+                ERR("accept4");
+        }
     }
-    return nfd;
 }
 
-void add_client(int client_socket[], int client)
+// A connection is only moved on the wheel when its slot comes up, activity
+// just pushes the deadline, so both are O(1)
+void expire_clients(connections *c, long now)
 {
-    int i;
-    for (i = 0; i < MAX_CLIENTS; i++) 
+    long last = now / TICK_MS;
+    int i, next;
+
+    if (last - c->tick > WHEEL_SLOTS)
+        c->tick = last - WHEEL_SLOTS;
+    while (c->tick < last)
     {
-        if (client_socket[i] == 0)
+        c->tick++;
+        i = c->wheel[c->tick % WHEEL_SLOTS];
+        c->wheel[c->tick % WHEEL_SLOTS] = -1;
+        for (; i >= 0; i = next)
         {
-            client_socket[i] = client;
-            printf("Added new client\n");
-            break;
+            next = c->slots[i].next;
+            if (c->slots[i].deadline > now)
+            {
+                wheel_insert(c, i);
+                continue;
+            }
+            close_client(c, i);
+            c->timed_out++;
+            LOG(LOG_INFO, "Client timed out.\n");
         }
     }
 }
@@ -172,119 +270,203 @@ int32_t get_max(int32_t data[])
     return max;
 }
 
+// One record per frame, so the format lists every number
 void print_data(int32_t data[])
 {
-    printf("(");
-    for (int i = 0; i < DATA_SIZE; i++)
+    _Static_assert(DATA_SIZE == 3, "print_data logs three numbers");
+    LOG(LOG_DEBUG, "Received data (%d, %d, %d)\n", ntohl(data[0]), ntohl(data[1]), ntohl(data[2]));
+}
+
+// Reply with a count and that many words, see query.h
+ssize_t answer_query(int socket, stats *st, int32_t data[], int32_t max_number)
+{
+    int32_t reply[QUERY_REPLY_MAX], arg = ntohl(data[2]), type = ntohl(data[1]);
+    uint64_t distinct;
+    int count = 0;
+
+    switch (type)
     {
-        if (i < DATA_SIZE - 1)
-            printf("%d, ", ntohl(data[i]));
-        else
-            printf("%d)\n", ntohl(data[i]));
+        case QUERY_MAX:
+            if (st->count)
+                reply[1 + count++] = max_number;
+            break;
+        case QUERY_TOP:
+            if (arg > 0 && arg <= QUERY_TOP_MAX)
+                count = stats_top(st, reply + 1, arg);
+            break;
+        case QUERY_QUANTILE:
+            if (arg >= 0 && arg <= 1000000)
+                count = stats_quantile(st, arg / 1e6, reply + 1);
+            break;
+        case QUERY_DISTINCT:
+            distinct = stats_distinct(st);
+            reply[1 + count++] = distinct > INT32_MAX ? INT32_MAX : distinct;
+            break;
     }
+
+    LOG(LOG_DEBUG, "Query %d (%d), answered with %d numbers\n", type, arg, count);
+    reply[0] = count;
+    for (int i = 0; i <= count; i++)
+        reply[i] = htonl(reply[i]);
+    return frame_write(socket, reply, (count + 1) * sizeof(int32_t));
 }
 
-void do_server(int fd)
+void do_server(int fd, int local_fd, int limit, long idle)
 {
-    int32_t data[DATA_SIZE];
-    int max_fd = fd;
-    int socket;
-    int client_socket[MAX_CLIENTS];
+    static stats st;
+    static connections conns;
+    connection *conn;
+    int32_t *data;
+    int max_fd;
     int received_count = 0;
     int max_number = 0;
-    int size;
-    fd_set base_rfds, rfds;
+    long now;
+    ssize_t size;
+    fd_set rfds;
+    struct timespec timeout, *ptimeout;
     sigset_t mask, oldmask;
 
-    FD_ZERO(&base_rfds);
-    FD_SET(fd, &base_rfds);
-
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-    initialize_clients(client_socket);
+    initialize_clients(&conns, limit, idle);
+    stats_init(&st);
 
     while (do_work)
     {
-        rfds = base_rfds;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        max_fd = fd;
+        if (local_fd >= 0)
+        {
+            FD_SET(local_fd, &rfds);
+            max_fd = max(max_fd, local_fd);
+        }
 
         // Add clients to set
         for (int i = 0; i < MAX_CLIENTS; i++)
         {
-            socket = client_socket[i];
+            if (conns.slots[i].fd > 0)
+                FD_SET(conns.slots[i].fd, &rfds);
+            if (conns.slots[i].fd > max_fd)
+                max_fd = conns.slots[i].fd;
+        }
 
-            if (socket > 0)
-                FD_SET(socket, &rfds);
-            
-            if (socket > max_fd)
-                max_fd = socket;
+        // Wake up for the next tick of the wheel
+        ptimeout = NULL;
+        if (conns.idle)
+        {
+            now = (conns.tick + 1) * TICK_MS - monotonic_ms();
+            if (now < 0)
+                now = 0;
+            timeout.tv_sec = now / 1000;
+            timeout.tv_nsec = now % 1000 * 1000000;
+            ptimeout = &timeout;
         }
 
         // Wait for activity
-        if (pselect(max_fd + 1, &rfds, NULL, NULL, NULL, &oldmask) > 0)
+        if (pselect(max_fd + 1, &rfds, NULL, NULL, ptimeout, &oldmask) < 0)
         {
-            // Incoming connection
-            if (FD_ISSET(fd, &rfds))
-            {
-                int client = accept_client(fd);
-                add_client(client_socket, client);
+            if (EINTR == errno)
+                continue;
+            ERR("pselect");
+        }
+        now = monotonic_ms();
+
+        // Incoming connections
+        if (FD_ISSET(fd, &rfds))
+            accept_clients(&conns, fd, now);
+        if (local_fd >= 0 && FD_ISSET(local_fd, &rfds))
+            accept_clients(&conns, local_fd, now);
+
+        // IO operation
+        for (int i = 0; i < MAX_CLIENTS; i++)
+        {
+            conn = &conns.slots[i];
+            if (conn->fd <= 0 || !FD_ISSET(conn->fd, &rfds))
                 continue;
+
+            switch (frame_read(conn->fd, conn->frame, sizeof(conn->frame), &conn->filled))
+            {
+                case 0:
+                    continue;
+                case -1:
+                    // EOF or an error of this connection only, the server goes on
+                    remove_client(&conns, i);
+                    LOG(LOG_INFO, "Client disconnected.\n");
+                    continue;
             }
+            conn->deadline = now + conns.idle;
+            data = conn->frame;
 
-            // IO operation
-            for (int i = 0; i < MAX_CLIENTS; i++)
+            if (ntohl(data[0]) == QUERY_MAGIC)
+                size = answer_query(conn->fd, &st, data, max_number);
+            else
             {
-                socket = client_socket[i];
-
-                if (FD_ISSET(socket, &rfds))
-                {
-                    if ((size = bulk_read(socket, (char *) data, sizeof(int32_t[DATA_SIZE]))) < 0 && ECONNRESET != errno) 
-                        ERR("read");
-                    
-                    if (size == (int) sizeof(int32_t[DATA_SIZE]))
-                    {
-                        printf("Received data ");
-                        print_data(data);
-                        
-                        int32_t received_max = get_max(data);
-                        if (received_count == 0 || received_max > max_number)
-                            max_number = received_max;
-                        received_count += DATA_SIZE;
-                        
-                        int32_t data_to_send = htonl(max_number);
-                        if (bulk_write(socket, (char *) &data_to_send, sizeof(int32_t)) < 0 && errno != EPIPE)
-                            ERR("write");
-
-                        printf("Sent data (%d)\n", max_number);
-                        
-                    }
-                    else
-                    {
-                        if (TEMP_FAILURE_RETRY(close(socket)) < 0)
-                            ERR("close");
-                        client_socket[i] = 0;
-                        printf("Client disconnected.\n");
-                    }
-                }
+                print_data(data);
+
+                int32_t received_max = get_max(data);
+                if (received_count == 0 || received_max > max_number)
+                    max_number = received_max;
+                received_count += DATA_SIZE;
+                for (int j = 0; j < DATA_SIZE; j++)
+                    stats_add(&st, ntohl(data[j]));
+
+                int32_t data_to_send = htonl(max_number);
+                if ((size = frame_write(conn->fd, &data_to_send, sizeof(int32_t))) >= 0)
+                    LOG(LOG_DEBUG, "Sent data (%d)\n", max_number);
+            }
+
+            // A client that does not read its answers is dropped
+            if (size < 0)
+            {
+                if (EPIPE != errno && ECONNRESET != errno && EAGAIN != errno)
+                    ERR("write");
+                remove_client(&conns, i);
+                LOG(LOG_INFO, "Client disconnected.\n");
             }
         }
-        else
-        {
-            if (EINTR == errno)
-                continue;
-            ERR("pselect");
-        }
+
+        if (conns.idle)
+            expire_clients(&conns, now);
     }
 
+    // The summary follows the last logged events
+    log_flush();
     printf("Received count: %d\n", received_count);
+    printf("Clients accepted: %ld, rejected: %ld, timed out: %ld\n", conns.accepted, conns.rejected,
+           conns.timed_out);
 }
 
 int main(int argc, char **argv)
 {
-    int fd, flags;
+    int fd, local_fd = -1, flags, c, limit = DEFAULT_CLIENTS, idle = DEFAULT_IDLE, backlog = BACKLOG;
+    char *path = NULL;
 
-    if (argc != 2)
+    while ((c = getopt(argc, argv, "c:i:b:u:")) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                limit = atoi(optarg);
+                break;
+            case 'i':
+                idle = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1 || limit < 1 || limit > MAX_CLIENTS || idle < 0 || backlog < 1)
     {
         usage(argv[0]);
         return EXIT_FAILURE;
@@ -294,14 +476,30 @@ int main(int argc, char **argv)
         ERR("Seting SIGPIPE");
     if (sethandler(sigint_handler, SIGINT))
         ERR("Seting SIGINT");
+    log_init();
 
-    fd = bind_inet_socket(atoi(argv[1]), SOCK_STREAM);
+    fd = bind_inet_socket(atoi(argv[optind]), SOCK_STREAM, backlog, 0);
     flags = fcntl(fd, F_GETFL) | O_NONBLOCK;
     fcntl(fd, F_SETFL, flags);
-    do_server(fd);
+    if (path)
+    {
+        local_fd = bind_local_socket(path, SOCK_STREAM, backlog);
+        flags = fcntl(local_fd, F_GETFL) | O_NONBLOCK;
+        fcntl(local_fd, F_SETFL, flags);
+    }
+    do_server(fd, local_fd, limit, idle * 1000L);
+
+    if (path)
+    {
+        if (TEMP_FAILURE_RETRY(close(local_fd)) < 0)
+            ERR("close");
+        if (unlink(path) < 0)
+            ERR("unlink");
+    }
 
     if (TEMP_FAILURE_RETRY(close(fd)) < 0)
         ERR("close");
+    log_close();
     fprintf(stderr, "Server has terminated.\n");
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "stats.h"
+
+#define ERR(source) (perror(source),                                 \
+                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                     exit(EXIT_FAILURE))
+
+void stats_init(stats *s)
+{
+    double capacity = KLL_K;
+
+    memset(s, 0, sizeof(stats));
+    for (int depth = 0; depth < KLL_MAX_LEVELS; depth++, capacity *= 2.0 / 3)
+        s->quantiles.capacity[depth] = capacity < KLL_MIN_CAPACITY ? KLL_MIN_CAPACITY : ceil(capacity);
+    s->quantiles.levels = 1;
+    s->quantiles.random = 0x9e3779b9;
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *) a, y = *(const int32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void heap_add(stats *s, int32_t value)
+{
+    int32_t *heap = s->heap;
+    int i, child;
+
+    if (s->heap_size < STATS_TOP)
+    {
+        for (i = s->heap_size++; i > 0 && heap[(i - 1) / 2] > value; i = (i - 1) / 2)
+            heap[i] = heap[(i - 1) / 2];
+        heap[i] = value;
+        return;
+    }
+    if (value <= heap[0])
+        return;
+
+    // Replace the smallest and sift it down
+    for (i = 0; (child = 2 * i + 1) < STATS_TOP; i = child)
+    {
+        if (child + 1 < STATS_TOP && heap[child + 1] < heap[child])
+            child++;
+        if (heap[child] >= value)
+            break;
+        heap[i] = heap[child];
+    }
+    heap[i] = value;
+}
+
+static uint32_t kll_capacity(kll *q, int level)
+{
+    return q->capacity[q->levels - 1 - level];
+}
+
+// Sorts the level and promotes every other item, an odd one out stays
+static void kll_compact(kll *q, int level)
+{
+    uint32_t n = q->size[level], offset;
+    int32_t *items = q->items[level], *up;
+
+    if (level + 1 == KLL_MAX_LEVELS)
+        return;
+    if (level + 1 == q->levels)
+        q->levels++;
+
+    qsort(items, n, sizeof(int32_t), compare_int32);
+    q->random ^= q->random << 13;
+    q->random ^= q->random >> 17;
+    q->random ^= q->random << 5;
+    offset = q->random & 1;
+
+    up = q->items[level + 1] + q->size[level + 1];
+    for (uint32_t i = 0; i < n / 2; i++)
+        up[i] = items[2 * i + offset];
+    q->size[level + 1] += n / 2;
+    if (n % 2)
+    {
+        items[0] = items[n - 1];
+        q->size[level] = 1;
+    }
+    else
+        q->size[level] = 0;
+}
+
+// Only the level that received items can overflow, lower levels whose
+// capacity shrank when a level was added are compacted on their next turn
+static void kll_add(kll *q, int32_t value)
+{
+    q->items[0][q->size[0]++] = value;
+    for (int level = 0; level < q->levels && q->size[level] >= kll_capacity(q, level); level++)
+        kll_compact(q, level);
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void hll_add(stats *s, int32_t value)
+{
+    uint64_t hash = mix64((uint32_t) value + 0x9e3779b97f4a7c15ULL);
+    uint32_t index = hash >> (64 - HLL_BITS);
+    uint8_t rank = __builtin_clzll(hash << HLL_BITS | 1ULL << (HLL_BITS - 1)) + 1;
+
+    if (rank > s->registers[index])
+        s->registers[index] = rank;
+}
+
+void stats_add(stats *s, int32_t value)
+{
+    s->count++;
+    heap_add(s, value);
+    kll_add(&s->quantiles, value);
+    hll_add(s, value);
+}
+
+static int compare_desc(const void *a, const void *b)
+{
+    return compare_int32(b, a);
+}
+
+int stats_top(stats *s, int32_t *out, int k)
+{
+    int32_t sorted[STATS_TOP];
+
+    memcpy(sorted, s->heap, s->heap_size * sizeof(int32_t));
+    qsort(sorted, s->heap_size, sizeof(int32_t), compare_desc);
+    if (k > s->heap_size)
+        k = s->heap_size;
+    memcpy(out, sorted, k * sizeof(int32_t));
+    return k;
+}
+
+typedef struct weighted
+{
+    int32_t value;
+    uint64_t weight;
+} weighted;
+
+static int compare_weighted(const void *a, const void *b)
+{
+    return compare_int32(&((const weighted *) a)->value, &((const weighted *) b)->value);
+}
+
+int stats_quantile(stats *s, double q, int32_t *value)
+{
+    kll *sketch = &s->quantiles;
+    weighted *items;
+    uint64_t total = 0, rank, seen = 0;
+    uint32_t n = 0;
+
+    if (!s->count)
+        return 0;
+    for (int level = 0; level < sketch->levels; level++)
+        n += sketch->size[level];
+    if (NULL == (items = malloc(n * sizeof(weighted))))
+        ERR("malloc");
+    n = 0;
+    for (int level = 0; level < sketch->levels; level++)
+        for (uint32_t i = 0; i < sketch->size[level]; i++)
+        {
+            items[n].value = sketch->items[level][i];
+            items[n++].weight = 1ULL << level;
+            total += 1ULL << level;
+        }
+    qsort(items, n, sizeof(weighted), compare_weighted);
+
+    rank = q * total;
+    *value = items[n - 1].value;
+    for (uint32_t i = 0; i < n; i++)
+        if ((seen += items[i].weight) > rank)
+        {
+            *value = items[i].value;
+            break;
+        }
+    free(items);
+    return 1;
+}
+
+uint64_t stats_distinct(stats *s)
+{
+    double sum = 0, m = HLL_REGISTERS, estimate;
+    int zeros = 0;
+
+    for (int i = 0; i < HLL_REGISTERS; i++)
+    {
+        sum += 1.0 / (1ULL << s->registers[i]);
+        zeros += !s->registers[i];
+    }
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Linear counting is more accurate while many registers are empty
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros);
+    return estimate + 0.5;
+}
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "query.h"
+
+// Streaming statistics over every number the server receives. Adding a
+// number costs O(log K) at most:
+// top K    - min-heap of the STATS_TOP largest numbers (duplicates count)
+// quantile - KLL sketch. Every level is a compactor of items weighing
+//            2^level. A full level is sorted and every other item, from a
+//            random offset, moves one level up. Capacities shrink by 2/3 per
+//            level down from KLL_K, rank error is about 1.7 / KLL_K, and
+//            two sketches merge by concatenating levels.
+// distinct - HyperLogLog with 2^HLL_BITS registers, error about 1.04 / 2^(HLL_BITS / 2)
+
+#define STATS_TOP QUERY_TOP_MAX
+#define KLL_K 200
+#define KLL_MIN_CAPACITY 8
+#define KLL_MAX_LEVELS 32
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+typedef struct kll
+{
+    int32_t items[KLL_MAX_LEVELS][2 * KLL_K]; // a level never holds more
+    uint32_t size[KLL_MAX_LEVELS];
+    uint32_t capacity[KLL_MAX_LEVELS]; // by depth below the top level
+    int levels;
+    uint32_t random;
+} kll;
+
+typedef struct stats
+{
+    uint64_t count;
+    int32_t heap[STATS_TOP];
+    int heap_size;
+    kll quantiles;
+    uint8_t registers[HLL_REGISTERS];
+} stats;
+
+void stats_init(stats *s);
+void stats_add(stats *s, int32_t value);
+
+// Up to k largest numbers into out, descending, returns how many
+int stats_top(stats *s, int32_t *out, int k);
+
+// Returns 0 when nothing has been received
+int stats_quantile(stats *s, double q, int32_t *value);
+
+uint64_t stats_distinct(stats *s);
+
+#endif